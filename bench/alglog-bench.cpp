@@ -0,0 +1,314 @@
+// Copyright(c) 2023-present, Kai Aoki
+// Under MIT license, but binary embeddable without copyright notice.
+// https://github.com/kuguma/alglog
+
+// 書き込み側のレイテンシ（p50 / p99 / p99.9 / max）と持続スループットを計測し、1ケース1行のJSONで出力する。
+// スレッド数・メッセージ長・sync / async・sinkと出力先の組み合わせを総当たりで計測する。
+// コンテナはコンパイル時に選択されるため、コンテナごとに別の実行ファイルとしてビルドされる。
+//
+// usage : alglog-bench [--out <file>] [--count <n>] [--threads 1,2,4,8] [--sizes 16,128,1024]
+//                      [--modes sync,async] [--sinks file,binary,mmap,print,async] [--tmpdir /dev/shm]
+
+#define ALGLOG_DIRECT_INCLUDE_GUARD
+#include <alglog.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef ALGLOG_BENCH_VERSION
+    #define ALGLOG_BENCH_VERSION "unknown"
+#endif
+
+namespace {
+
+    #if defined(ALGLOG_CONTAINER_MPSC_RINGBUFFER)
+        constexpr const char* container_name = "mpsc";
+    #elif defined(ALGLOG_CONTAINER_SPSC_PER_THREAD)
+        constexpr const char* container_name = "spsc_per_thread";
+    #elif defined(ALGLOG_CONTAINER_BYTE_RINGBUFFER)
+        constexpr const char* container_name = "byte_ringbuffer";
+    #else
+        constexpr const char* container_name = "std_list";
+    #endif
+
+    struct options{
+        std::string out = "alglog_bench.jsonl";
+        size_t count = 200000; // 1ケースあたりの総ログ数（スレッドで等分する）
+        std::vector<size_t> threads = {1, 2, 4, 8};
+        std::vector<size_t> sizes = {16, 128, 1024};
+        std::vector<std::string> modes = {"sync", "async"};
+        std::vector<std::string> sinks = {"file", "binary", "mmap", "print", "async"};
+        std::string tmpdir = "/dev/shm";
+    };
+
+    struct result{
+        uint64_t p50 = 0;
+        uint64_t p99 = 0;
+        uint64_t p999 = 0;
+        uint64_t max = 0;
+        double seconds = 0;
+        uint64_t dropped = 0;
+        uint64_t max_depth = 0;
+        uint64_t flush_ns_max = 0;
+    };
+
+    void usage(){
+        std::cerr << "usage : alglog-bench [--out <file>] [--count <n>] [--threads 1,2,4,8] [--sizes 16,128,1024]\n"
+                     "                     [--modes sync,async] [--sinks file,binary,mmap,print,async] [--tmpdir /dev/shm]" << std::endl;
+    }
+
+    std::vector<std::string> split(const std::string& s){
+        std::vector<std::string> v;
+        std::stringstream ss(s);
+        std::string item;
+        while (std::getline(ss, item, ',')){
+            if (!item.empty()){
+                v.push_back(item);
+            }
+        }
+        return v;
+    }
+
+    std::vector<size_t> split_numbers(const std::string& s){
+        std::vector<size_t> v;
+        for (const auto& item : split(s)){
+            v.push_back(std::stoul(item));
+        }
+        return v;
+    }
+
+    bool is_writable_dir(const std::string& dir){
+        const auto probe = dir + "/alglog_bench_probe";
+        std::ofstream ofs(probe);
+        if (!ofs){
+            return false;
+        }
+        ofs.close();
+        std::remove(probe.c_str());
+        return true;
+    }
+
+    // print_sinkの出力先を差し替えるため、計測中だけstd::coutのバッファを付け替える。
+    struct cout_redirect{
+        std::ofstream ofs;
+        std::streambuf* prev = nullptr;
+        explicit cout_redirect(const std::string& path) : ofs(path, std::ios::binary) {
+            prev = std::cout.rdbuf(ofs.rdbuf());
+        }
+        ~cout_redirect(){
+            std::cout.rdbuf(prev);
+        }
+    };
+
+    std::shared_ptr<alglog::sink> make_sink(const std::string& name, const std::string& path){
+        if (name == "file"){
+            return std::make_shared<alglog::builtin::file_sink>(path);
+        }
+        if (name == "binary"){
+            return std::make_shared<alglog::builtin::binary_file_sink>(path);
+        }
+        #if !(defined(_WIN32) || defined(_WIN64))
+            if (name == "mmap"){
+                return std::make_shared<alglog::builtin::mmap_file_sink>(path);
+            }
+        #endif
+        if (name == "print"){
+            return std::make_shared<alglog::builtin::print_sink>();
+        }
+        if (name == "async"){
+            return std::make_shared<alglog::builtin::async_sink>(std::make_shared<alglog::builtin::file_sink>(path));
+        }
+        return nullptr;
+    }
+
+    bool is_known_sink(const std::string& name){
+        #if !(defined(_WIN32) || defined(_WIN64))
+            if (name == "mmap"){
+                return true;
+            }
+        #endif
+        return name == "file" || name == "binary" || name == "print" || name == "async";
+    }
+
+    // tmpfsに書き出したファイルを削除する。mmap_file_sinkはセグメントごとに別ファイルになる。
+    void remove_outputs(const std::string& path){
+        std::remove(path.c_str());
+        for (uint64_t i = 0; std::remove(alglog::detail::segment_path(path, i).c_str()) == 0; ++i){}
+    }
+
+    uint64_t percentile(const std::vector<uint64_t>& sorted, double p){
+        if (sorted.empty()){
+            return 0;
+        }
+        const auto i = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1));
+        return sorted[i];
+    }
+
+    result run_case(const std::string& mode, const std::string& sink_name, const std::string& path, size_t num_threads, size_t msg_size, size_t count){
+        std::unique_ptr<cout_redirect> redirect;
+        if (sink_name == "print"){
+            redirect = std::make_unique<cout_redirect>(path);
+        }
+
+        auto lgr = std::make_shared<alglog::logger>(mode == "async");
+        auto sink = make_sink(sink_name, path);
+        sink->valve = alglog::builtin::valve::always_open;
+        lgr->connect_sink(sink);
+        std::unique_ptr<alglog::flusher> flusher;
+        if (mode == "async"){
+            flusher = std::make_unique<alglog::flusher>(lgr);
+            flusher->start(10);
+        }
+
+        const std::string payload(msg_size, 'x');
+        const size_t per_thread = std::max<size_t>(count / num_threads, 1);
+        std::vector<std::vector<uint64_t>> latencies(num_threads);
+        std::atomic<size_t> ready{0};
+        std::atomic<bool> go{false};
+
+        std::vector<std::thread> producers;
+        for (size_t t = 0; t < num_threads; ++t){
+            producers.emplace_back([&, t]{
+                auto& lat = latencies[t];
+                lat.reserve(per_thread);
+                ready.fetch_add(1);
+                while (!go.load(std::memory_order_acquire)){
+                    std::this_thread::yield();
+                }
+                for (size_t i = 0; i < per_thread; ++i){
+                    const auto s = std::chrono::steady_clock::now();
+                    lgr->info("{} {}", i, payload);
+                    const auto e = std::chrono::steady_clock::now();
+                    lat.push_back(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(e - s).count()));
+                }
+            });
+        }
+        while (ready.load() != num_threads){
+            std::this_thread::yield();
+        }
+
+        const auto begin = std::chrono::steady_clock::now();
+        go.store(true, std::memory_order_release);
+        for (auto& th : producers){
+            th.join();
+        }
+        // 持続スループットには、全てのログがsinkへ書き出されるまでの時間を含める。
+        flusher.reset();
+        lgr->flush();
+        if (auto as = std::dynamic_pointer_cast<alglog::builtin::async_sink>(sink)){
+            as->drain();
+        }
+        const auto end = std::chrono::steady_clock::now();
+
+        result r;
+        r.seconds = std::chrono::duration<double>(end - begin).count();
+        const auto t = lgr->telemetry();
+        r.dropped = t.dropped;
+        r.max_depth = t.max_depth;
+        r.flush_ns_max = t.flush_ns_max;
+
+        std::vector<uint64_t> all;
+        all.reserve(per_thread * num_threads);
+        for (const auto& lat : latencies){
+            all.insert(all.end(), lat.begin(), lat.end());
+        }
+        std::sort(all.begin(), all.end());
+        r.p50 = percentile(all, 0.50);
+        r.p99 = percentile(all, 0.99);
+        r.p999 = percentile(all, 0.999);
+        r.max = all.empty() ? 0 : all.back();
+        return r;
+    }
+
+}
+
+int main(int argc, char** argv){
+    options opt;
+    try{
+        for (int i = 1; i < argc; ++i){
+            const std::string arg = argv[i];
+            if (i + 1 >= argc){
+                usage();
+                return 2;
+            }
+            const std::string value = argv[++i];
+            if (arg == "--out"){
+                opt.out = value;
+            }else if (arg == "--count"){
+                opt.count = std::stoul(value);
+            }else if (arg == "--threads"){
+                opt.threads = split_numbers(value);
+            }else if (arg == "--sizes"){
+                opt.sizes = split_numbers(value);
+            }else if (arg == "--modes"){
+                opt.modes = split(value);
+            }else if (arg == "--sinks"){
+                opt.sinks = split(value);
+            }else if (arg == "--tmpdir"){
+                opt.tmpdir = value;
+            }else{
+                usage();
+                return 2;
+            }
+        }
+    }catch(const std::exception&){
+        usage();
+        return 2;
+    }
+
+    std::ofstream out(opt.out);
+    if (!out){
+        std::cerr << "alglog-bench : cannot open " << opt.out << std::endl;
+        return 1;
+    }
+
+    // 出力先 : /dev/null（書き込みのコストを除いた上限）と tmpfs（ディスクI/Oを除いたファイル書き込み）
+    std::vector<std::pair<std::string, std::string>> targets;
+    #if !(defined(_WIN32) || defined(_WIN64))
+        targets.emplace_back("devnull", "/dev/null");
+    #endif
+    if (is_writable_dir(opt.tmpdir)){
+        targets.emplace_back("tmpfs", opt.tmpdir + "/alglog_bench.log");
+    }else{
+        std::cerr << "alglog-bench : " << opt.tmpdir << " is not writable, skip tmpfs targets" << std::endl;
+    }
+
+    for (const auto& sink_name : opt.sinks){
+        for (const auto& [target_name, path] : targets){
+            if (sink_name == "mmap" && target_name == "devnull"){
+                continue; // /dev/nullはmmapできない
+            }
+            if (!is_known_sink(sink_name)){
+                std::cerr << "alglog-bench : unknown sink " << sink_name << std::endl;
+                break;
+            }
+            for (const auto& mode : opt.modes){
+                for (auto num_threads : opt.threads){
+                    for (auto msg_size : opt.sizes){
+                        const auto r = run_case(mode, sink_name, path, num_threads, msg_size, opt.count);
+                        const auto total = std::max<size_t>(opt.count / num_threads, 1) * num_threads;
+                        const auto line = fmt::format(
+                            "{{\"version\":\"{}\",\"container\":\"{}\",\"mode\":\"{}\",\"sink\":\"{}\",\"target\":\"{}\","
+                            "\"threads\":{},\"msg_size\":{},\"count\":{},\"p50_ns\":{},\"p99_ns\":{},\"p999_ns\":{},\"max_ns\":{},"
+                            "\"seconds\":{:.6f},\"msgs_per_sec\":{:.0f},\"dropped\":{},\"max_depth\":{},\"flush_max_ns\":{}}}",
+                            ALGLOG_BENCH_VERSION, container_name, mode, sink_name, target_name,
+                            num_threads, msg_size, total, r.p50, r.p99, r.p999, r.max,
+                            r.seconds, static_cast<double>(total) / r.seconds, r.dropped, r.max_depth, r.flush_ns_max);
+                        out << line << std::endl;
+                        std::cerr << line << std::endl;
+                        if (target_name == "tmpfs"){
+                            remove_outputs(path);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
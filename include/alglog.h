@@ -22,12 +22,33 @@
 #include <array>
 #include <functional>
 #include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <initializer_list>
+#include <iterator>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <cmath>
+#include <limits>
+#include <cerrno>
 #include <memory>
 #include <fstream>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <istream>
 #include <cassert>
+#include <algorithm>
+#include <filesystem>
 #include "mpsc_ring_buffer.h"
+#include "spsc_ring_buffer.h"
+#include "byte_ring_buffer.h"
 
 
 /* ----------------------------------------------------------------------------
@@ -95,14 +116,93 @@
     }
 #endif
 
-// スレッドIDを取得する。もしくは機能を利用しない。
-#ifdef ALGLOG_GETTID
-    inline std::thread::id get_thread_id(){
-        return std::this_thread::get_id();
+// カーネルのスレッドIDを取得する。もしくは機能を利用しない。
+// top -H や perf 等の出力と対応づけられる値を返す。スレッドごとに一度だけ呼ばれる。
+#if defined(ALGLOG_GETTID) && (defined(_WIN32) || defined(_WIN64))
+    #include <windows.h>
+    inline uint64_t get_os_thread_id(){
+        return static_cast<uint64_t>(GetCurrentThreadId());
+    }
+#elif defined(ALGLOG_GETTID) && defined(__linux__)
+    #include <unistd.h>
+    #include <sys/syscall.h>
+    inline uint64_t get_os_thread_id(){
+        return static_cast<uint64_t>(::syscall(SYS_gettid));
+    }
+#elif defined(ALGLOG_GETTID) && defined(__APPLE__)
+    #include <pthread.h>
+    inline uint64_t get_os_thread_id(){
+        uint64_t id = 0;
+        pthread_threadid_np(nullptr, &id);
+        return id;
+    }
+#elif defined(ALGLOG_GETTID)
+    inline uint64_t get_os_thread_id(){
+        return static_cast<uint64_t>(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    }
+#else
+    inline uint64_t get_os_thread_id(){
+        return 0;
+    }
+#endif
+
+// ファイル書き込み用の低レベルI/O
+#if defined(_WIN32) || defined(_WIN64)
+    #include <io.h>
+    #include <fcntl.h>
+    #include <share.h>
+    #include <sys/stat.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <pthread.h>
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+    #include <sys/uio.h>
+    #include <sys/un.h>
+    #include <netdb.h>
+    #if defined(__linux__)
+        #include <linux/falloc.h>
+    #endif
+#endif
+
+// CPUのタイムスタンプカウンタ(TSC)を読む。もしくは機能を利用しない。
+// 不変TSC(invariant TSC)を持たないCPUでは利用できないため、tsc_available()で確認すること。
+#if defined(ALGLOG_TSC_CLOCK) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+    #else
+        #include <x86intrin.h>
+        #include <cpuid.h>
+    #endif
+    inline uint64_t read_tsc(){
+        return static_cast<uint64_t>(__rdtsc());
+    }
+    inline bool tsc_available(){
+        unsigned int regs[4] = {0, 0, 0, 0};
+    #if defined(_MSC_VER)
+        int r[4];
+        __cpuid(r, 0x80000000);
+        if (static_cast<unsigned int>(r[0]) < 0x80000007u){
+            return false;
+        }
+        __cpuid(r, 0x80000007);
+        regs[3] = static_cast<unsigned int>(r[3]);
+    #else
+        if (__get_cpuid_max(0x80000000, nullptr) < 0x80000007u){
+            return false;
+        }
+        __get_cpuid(0x80000007, &regs[0], &regs[1], &regs[2], &regs[3]);
+    #endif
+        return (regs[3] & (1u << 8)) != 0; // EDX bit 8 : invariant TSC
     }
 #else
-    inline std::thread::id get_thread_id(){
-        return std::thread::id();
+    inline uint64_t read_tsc(){
+        return 0;
+    }
+    inline bool tsc_available(){
+        return false;
     }
 #endif
 
@@ -171,6 +271,49 @@ enum class level{
     trace // 挙動を追うときに使う詳細なログ。機能開発中や、込み入ったバグを追いかけるときに使う。
 };
 
+// レベルの集合を表すビットマスク。sinkが受け付けるレベルや、loggerの実行時閾値に用いる。
+using level_mask = uint32_t;
+
+constexpr level_mask level_bit(level lvl){
+    return 1u << static_cast<int>(lvl);
+}
+
+// lvl以上に重要なレベル（lvl自身を含む）のマスク
+constexpr level_mask levels_up_to(level lvl){
+    return (level_bit(lvl) << 1) - 1;
+}
+
+constexpr level_mask all_levels = levels_up_to(level::trace);
+
+// コンパイルスイッチ（ALGLOG_*_ON）で有効になっているレベルのマスク
+constexpr level_mask compiled_levels = 0
+#ifdef ALGLOG_ERROR_ON
+    | level_bit(level::error)
+#endif
+#ifdef ALGLOG_ALERT_ON
+    | level_bit(level::alert)
+#endif
+#ifdef ALGLOG_INFO_ON
+    | level_bit(level::info)
+#endif
+#ifdef ALGLOG_CRITICAL_ON
+    | level_bit(level::critical)
+#endif
+#ifdef ALGLOG_WARN_ON
+    | level_bit(level::warn)
+#endif
+#ifdef ALGLOG_DEBUG_ON
+    | level_bit(level::debug)
+#endif
+#ifdef ALGLOG_TRACE_ON
+    | level_bit(level::trace)
+#endif
+    ;
+
+constexpr bool is_compiled(level lvl){
+    return (compiled_levels & level_bit(lvl)) != 0;
+}
+
 
 // ソース位置（マクロを利用して流し込む）
 struct source_location {
@@ -182,400 +325,4591 @@ struct source_location {
         : file(file), line(line), func(func) {}
 };
 
-// ログクラス
-struct log_t{
-    std::string msg;
-    level lvl;
-    std::chrono::time_point<std::chrono::system_clock> time;
-    uint32_t pid;
-    std::thread::id tid;
-    source_location loc;
-    std::string get_level_str() const {
-        if (lvl == level::error){
-            return " ERR";
-        }
-        if (lvl == level::alert){
-            return "ALRT";
-        }
-        if (lvl == level::info){
-            return "INFO";
-        }
-        if (lvl == level::critical){
-            return "CRIT";
-        }
-        if (lvl == level::warn){
-            return "WARN";
-        }
-        if (lvl == level::debug){
-            return " DBG";
-        }
-        if (lvl == level::trace){
-            return "TRCE";
-        }
-        return "----";
-    }
-};
+// ログ出力箇所ごとの記述子。ALGLOG_SRの展開ごとに静的に1つ作られ、初回の呼び出し時にレジストリへ登録される。
+// 実行中に出力箇所単位で有効・無効を切り替えたり、出力頻度を制限したりできる（set_callsite_enabled等を参照）。
+class callsite{
+private:
+    std::atomic<bool> enabled{true};
+    std::atomic<int> first_level{-1}; // 最初に記録されたレベル
+    std::atomic<int64_t> interval_ns{0}; // 頻度制限 : 1件あたりの間隔。0で制限なし
+    std::atomic<int64_t> burst_ns{0}; // 頻度制限 : 連続して許容する量（間隔 × バースト数）
+    std::atomic<int64_t> tat{0}; // 頻度制限 : 次のログの理論到着時刻（GCRA）
+    std::atomic<uint64_t> suppressed_num{0};
+    callsite* next = nullptr;
 
+    static std::atomic<callsite*>& head(){
+        static std::atomic<callsite*> h{nullptr};
+        return h;
+    }
 
-// ------------------------------------
-// Log収集用コンテナ
+    // GCRAによるトークンバケット。1つのアトミック変数だけで判定する。
+    bool take_token(int64_t interval){
+        const int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        const int64_t burst = burst_ns.load(std::memory_order_relaxed);
+        int64_t t = tat.load(std::memory_order_relaxed);
+        while (true){
+            const int64_t next_tat = std::max(t, now) + interval;
+            if (next_tat - now > burst){
+                return false;
+            }
+            if (tat.compare_exchange_weak(t, next_tat, std::memory_order_relaxed)){
+                return true;
+            }
+        }
+    }
 
-// alglogで用いるログコンテナのインターフェース。
-// 任意の実装を利用可能だが、スレッドセーフ or ロックフリーの実装を推奨する。
-class log_container_interface{
 public:
-    // ログを追加する。追加に成功したらtrueを返す。
-    // ブロック不可。
-    virtual bool push(const log_t&) = 0;
-
-    // ログを取り出す。取り出しに成功したらtrueを返す。
-    // ブロック不可。
-    virtual bool pop(log_t&) = 0;
-};
+    const source_location loc;
 
+    callsite(const char* file, int line, const char* func) : loc(file, line, func) {
+        auto& h = head();
+        next = h.load(std::memory_order_relaxed);
+        while (!h.compare_exchange_weak(next, this, std::memory_order_release, std::memory_order_relaxed)){}
+    }
+    callsite(const callsite&) = delete;
+    callsite& operator=(const callsite&) = delete;
 
-// std::listとmtxを使った簡易スレッドセーフ実装。
-// ほぼ無限に書き込めるが、ロックが長く低速。
-class log_container_std_list : public log_container_interface{
-private:
-    std::list<log_t> c;
-    mutable std::mutex mtx;
-public:
-    bool push(const log_t& l) override {
-        std::lock_guard<std::mutex> lock(mtx);
-        c.push_back(l);
-        return true;
+    operator source_location() const {
+        return loc;
     }
-    bool pop(log_t& l) override {
-        std::lock_guard<std::mutex> lock(mtx);
-        if (c.empty()){
+
+    // このログを出力してよいか。無効化されている、または頻度制限を超えた場合はfalseを返す。
+    bool admit(level lvl){
+        if (!enabled.load(std::memory_order_relaxed)){
+            return false;
+        }
+        if (first_level.load(std::memory_order_relaxed) < 0){
+            first_level.store(static_cast<int>(lvl), std::memory_order_relaxed);
+        }
+        const auto interval = interval_ns.load(std::memory_order_relaxed);
+        if (interval != 0 && !take_token(interval)){
+            suppressed_num.fetch_add(1, std::memory_order_relaxed);
             return false;
         }
-        l = c.front();
-        c.pop_front();
         return true;
     }
-};
 
-// multi producer / single consumer のリングバッファ。
-// 容量に制限があり、内容量に関わらずメモリを消費する。
-// 制限を超える分は書込みに失敗するが、ロックフリーで比較的高速。
-template <size_t N>
-class log_container_mpsc : public log_container_interface{
-private:
-    mpsc_ring_buffer<log_t, N> c;
-public:
-    bool push(const log_t& l) override {
-        return c.push(l);
+    void set_enabled(bool e){
+        enabled.store(e, std::memory_order_relaxed);
     }
-    bool pop(log_t& l) override {
-        return c.pop(l);
+    bool is_enabled() const {
+        return enabled.load(std::memory_order_relaxed);
     }
-};
-
-#if defined(ALGLOG_CONTAINER_MPSC_RINGBUFFER)
-    #if defined (ALGLOG_MPSC_RINGBUFFER_SIZE)
-        using log_container_t = log_container_mpsc<ALGLOG_MPSC_RINGBUFFER_SIZE>;
-    #else
-        using log_container_t = log_container_mpsc<1024 * 16>;
-    #endif
-#else
-    // default
-    using log_container_t = log_container_std_list;
-#endif
 
-// ------------------------------------
-// Core
+    // 1秒あたりper_second件まで、最大burst件の連続を許容する。per_secondが0なら制限を解除する。
+    void set_rate_limit(double per_second, uint32_t burst = 1){
+        if (per_second <= 0){
+            interval_ns.store(0, std::memory_order_relaxed);
+            return;
+        }
+        const auto interval = static_cast<int64_t>(1e9 / per_second);
+        burst_ns.store(interval * static_cast<int64_t>(std::max<uint32_t>(burst, 1)), std::memory_order_relaxed);
+        tat.store(0, std::memory_order_relaxed);
+        interval_ns.store(interval, std::memory_order_relaxed);
+    }
 
-struct sink{
-    std::function<bool(const log_t&)> valve = nullptr; // データを出力するかを判断する関数
-    std::function<std::string(const log_t&)> formatter = nullptr; // sinkはformatterを持ち、出力の際に利用する。
-    virtual void output(const log_t&) = 0; // ログ出力のタイミングで接続されているloggerからこのoutputが呼び出される。
-    void _cond_output(log_t& l){
-        if (valve(l)){
-            output(l);
+    // 最初に記録されたレベル。まだ記録されていなければfalseを返す。
+    bool get_level(level& lvl) const {
+        const int l = first_level.load(std::memory_order_relaxed);
+        if (l < 0){
+            return false;
         }
+        lvl = static_cast<level>(l);
+        return true;
     }
-    virtual ~sink(){}
-};
 
-class logger{
-private:
-    log_container_t logs;
-    std::vector<std::shared_ptr<sink>> sinks; // loggerは自分が持っているsink全てに入力されたlogを受け渡す。
-    std::mutex sinks_mtx;
-public:
-    const bool async_mode; // 非同期モードフラグ。非同期モードでは手動でflushする必要がある。同期モードではログ記録と同時に自動的にflush()が呼ばれる。
-    logger(bool async_mode = false) : async_mode(async_mode) {}
-    ~logger(){
-        flush(); // 終了時に必ずフラッシュする
+    // 頻度制限により破棄されたログの累計数
+    uint64_t suppressed() const {
+        return suppressed_num.load(std::memory_order_relaxed);
     }
 
-    void connect_sink(std::shared_ptr<sink> s){
-        std::lock_guard<std::mutex> lock(sinks_mtx);
-        sinks.push_back(s);
+    // 登録済みの全ての記述子を列挙する。記述子は静的変数であり、プログラムの終了まで有効。
+    template <class F>
+    static void for_each(F&& f){
+        for (auto c = head().load(std::memory_order_acquire); c; c = c->next){
+            f(*c);
+        }
     }
+};
 
-    // 保管されているログを全て出力する。
-    void flush(){
-        while(true){
-            log_t l;
-            auto ret = logs.pop(l);
-            if (!ret){
-                break;
-            }
-            for(auto& s : sinks){
-                s->_cond_output(l);
+// 登録済みの出力箇所の一覧
+inline std::vector<callsite*> list_callsites(){
+    std::vector<callsite*> v;
+    callsite::for_each([&](callsite& c){ v.push_back(&c); });
+    return v;
+}
+
+namespace detail{
+    // fileはベースネームで比較する。lineが0の場合はファイル内の全ての出力箇所に一致する。
+    template <class F>
+    size_t configure_callsites(std::string_view file, int line, F&& f){
+        size_t n = 0;
+        callsite::for_each([&](callsite& c){
+            if (file == c.loc.file && (line == 0 || line == c.loc.line)){
+                f(c);
+                ++n;
             }
-        }
+        });
+        return n;
     }
+}
 
-    // ------------------------------------
-    // ログ保管
+// 出力箇所の有効・無効を切り替える。一致した出力箇所の数を返す。
+inline size_t set_callsite_enabled(std::string_view file, int line, bool enabled){
+    return detail::configure_callsites(file, line, [&](callsite& c){ c.set_enabled(enabled); });
+}
 
-    // ログを保管する。
-    // すべてのログ出力はこのraw_storeを通る。
-    void raw_store(source_location loc, const level lvl, const std::string& msg){
-        log_t log = {
-            msg,
-            lvl,
-            std::chrono::system_clock::now(),
-            get_process_id(),
-            get_thread_id(),
-            loc
-        };
-        logs.push(log);
-        if (!async_mode){
-            flush();
-        }
+// 出力箇所の頻度制限を設定する。一致した出力箇所の数を返す。
+inline size_t set_callsite_rate_limit(std::string_view file, int line, double per_second, uint32_t burst = 1){
+    return detail::configure_callsites(file, line, [&](callsite& c){ c.set_rate_limit(per_second, burst); });
+}
+
+// ------------------------------------
+// 遅延フォーマット
+
+// 遅延フォーマットでログに保存できる引数の合計サイズ（バイト）。
+#ifndef ALGLOG_DEFERRED_ARGS_SIZE
+    #define ALGLOG_DEFERRED_ARGS_SIZE 64
+#endif
+
+// 引数をコピーしたまま遅延フォーマットしてよい型かどうか。
+// 参照先を持たない型のみ対象とする（fmt::joinのようなビュー型はflush時にダングリングするため除外）。
+// トリビアルコピー可能な自作型は、このテンプレートを特殊化することで遅延対象にできる。
+template <class T>
+struct is_deferrable : std::integral_constant<bool,
+    std::is_arithmetic<T>::value || std::is_enum<T>::value || std::is_pointer<T>::value> {};
+
+template <class Rep, class Period>
+struct is_deferrable<std::chrono::duration<Rep, Period>> : std::true_type {};
+
+template <class Clock, class Duration>
+struct is_deferrable<std::chrono::time_point<Clock, Duration>> : std::true_type {};
+
+namespace detail{
+    // 遅延保存する際の引数の型。文字列はstd::stringとしてコピーを所有する。
+    template <class T>
+    struct deferred_arg{
+        using type = T;
+        static constexpr bool storable = is_deferrable<T>::value;
+    };
+    template <> struct deferred_arg<const char*> { using type = std::string; static constexpr bool storable = true; };
+    template <> struct deferred_arg<char*> { using type = std::string; static constexpr bool storable = true; };
+    template <> struct deferred_arg<std::string> { using type = std::string; static constexpr bool storable = true; };
+    template <> struct deferred_arg<std::string_view> { using type = std::string; static constexpr bool storable = true; };
+    template <> struct deferred_arg<fmt::string_view> { using type = std::string; static constexpr bool storable = true; };
+
+    template <class T>
+    using deferred_arg_t = typename deferred_arg<std::decay_t<T>>::type;
+
+    template <class ... T>
+    using deferred_tuple_t = std::tuple<deferred_arg_t<T>...>;
+
+    template <class ... T>
+    struct all_storable : std::true_type {};
+    template <class H, class ... T>
+    struct all_storable<H, T...> : std::integral_constant<bool,
+        deferred_arg<std::decay_t<H>>::storable && all_storable<T...>::value> {};
+}
+
+// 引数のコピーを保持し、flush時にフォーマットする。
+// フォーマット文字列は保持しない。fmt::runtimeで渡された一時的な文字列もありうるため、
+// 呼び出し側（logger）がlog_t::msgへコピーしておき、format_toに渡す。
+class deferred_format{
+private:
+    enum class op { copy, move, destroy };
+    using storage_t = typename std::aligned_storage<ALGLOG_DEFERRED_ARGS_SIZE, alignof(std::max_align_t)>::type;
+
+    void (*format_fn)(fmt::string_view, const void*, fmt::memory_buffer&) = nullptr;
+    void (*manage_fn)(op, void*, void*) = nullptr; // nullptrの場合はトリビアルコピー可能
+    storage_t storage;
+
+    template <class Tuple>
+    static void format_impl(fmt::string_view f, const void* p, fmt::memory_buffer& buf){
+        const auto& t = *static_cast<const Tuple*>(p);
+        apply_format(f, t, buf, std::make_index_sequence<std::tuple_size<Tuple>::value>{});
     }
 
-    void raw_store(const level lvl, const std::string& msg){
-        raw_store(source_location{}, lvl, msg);
+    template <class Tuple, size_t ... I>
+    static void apply_format(fmt::string_view f, const Tuple& t, fmt::memory_buffer& buf, std::index_sequence<I...>){
+        fmt::vformat_to(std::back_inserter(buf), f, fmt::make_format_args(std::get<I>(t)...));
     }
 
-    template <class ... T>
-    void fmt_store(source_location loc, const level lvl, fmt::format_string<T...> fmt, T&&... args){
-        // TODO : C++17以降であればconstexpr ifを使える
-        switch(lvl){
-            case level::error:
-                #ifdef ALGLOG_ERROR_ON
-                    raw_store(loc, lvl, fmt::format(fmt, std::forward<T>(args)...));
-                #endif
-                break;
-            case level::alert:
-                #ifdef ALGLOG_ALERT_ON
-                    raw_store(loc, lvl, fmt::format(fmt, std::forward<T>(args)...));
-                #endif
-                break;
-            case level::info:
-                #ifdef ALGLOG_INFO_ON
-                    raw_store(loc, lvl, fmt::format(fmt, std::forward<T>(args)...));
-                #endif
-                break;
-            case level::critical:
-                #ifdef ALGLOG_CRITICAL_ON
-                    raw_store(loc, lvl, fmt::format(fmt, std::forward<T>(args)...));
-                #endif
-                break;
-            case level::warn:
-                #ifdef ALGLOG_WARN_ON
-                    raw_store(loc, lvl, fmt::format(fmt, std::forward<T>(args)...));
-                #endif
-                break;
-            case level::debug:
-                #ifdef ALGLOG_DEBUG_ON
-                    raw_store(loc, lvl, fmt::format(fmt, std::forward<T>(args)...));
-                #endif
+    template <class Tuple>
+    static void manage_impl(op o, void* dst, void* src){
+        switch(o){
+            case op::copy:
+                new (dst) Tuple(*static_cast<const Tuple*>(src));
                 break;
-            case level::trace:
-                #ifdef ALGLOG_TRACE_ON
-                    raw_store(loc, lvl, fmt::format(fmt, std::forward<T>(args)...));
-                #endif
+            case op::move:
+                new (dst) Tuple(std::move(*static_cast<Tuple*>(src)));
                 break;
-            default:
+            case op::destroy:
+                static_cast<Tuple*>(dst)->~Tuple();
                 break;
         }
     }
 
-    template <class ... T>
-    void fmt_store(const level lvl, fmt::format_string<T...> fmt, T&&... args){
-        fmt_store(source_location{}, lvl, fmt, std::forward<T>(args)...);
+    void assign_from(const deferred_format& o){
+        format_fn = o.format_fn;
+        manage_fn = o.manage_fn;
+        if (!format_fn){
+            return;
+        }
+        if (manage_fn){
+            manage_fn(op::copy, &storage, const_cast<storage_t*>(&o.storage));
+        }else{
+            std::memcpy(&storage, &o.storage, sizeof(storage_t));
+        }
     }
 
-    // ----------------------------------------------
+    void assign_from(deferred_format&& o){
+        format_fn = o.format_fn;
+        manage_fn = o.manage_fn;
+        if (!format_fn){
+            return;
+        }
+        if (manage_fn){
+            manage_fn(op::move, &storage, &o.storage);
+        }else{
+            std::memcpy(&storage, &o.storage, sizeof(storage_t));
+        }
+        o.reset();
+    }
 
+public:
+    // 引数列T...が遅延フォーマット可能かどうか
     template <class ... T>
-    void error(fmt::format_string<T...> fmt, T&&... args){
-        #ifdef ALGLOG_ERROR_ON
-            raw_store(level::error, fmt::format(fmt, std::forward<T>(args)...));
-        #endif
+    static constexpr bool storable(){
+        using tuple_t = detail::deferred_tuple_t<T...>;
+        return detail::all_storable<T...>::value
+            && sizeof(tuple_t) <= sizeof(storage_t)
+            && alignof(tuple_t) <= alignof(storage_t);
     }
 
-    template <class ... T>
-    void alert(fmt::format_string<T...> fmt, T&&... args){
-        #ifdef ALGLOG_ALERT_ON
-            raw_store(level::alert, fmt::format(fmt, std::forward<T>(args)...));
-        #endif
+    deferred_format() = default;
+    deferred_format(const deferred_format& o) { assign_from(o); }
+    deferred_format(deferred_format&& o) noexcept { assign_from(std::move(o)); }
+    deferred_format& operator=(const deferred_format& o){
+        if (this != &o){
+            reset();
+            assign_from(o);
+        }
+        return *this;
+    }
+    deferred_format& operator=(deferred_format&& o) noexcept {
+        if (this != &o){
+            reset();
+            assign_from(std::move(o));
+        }
+        return *this;
+    }
+    ~deferred_format(){
+        reset();
     }
 
     template <class ... T>
-    void info(fmt::format_string<T...> fmt, T&&... args){
-        #ifdef ALGLOG_INFO_ON
-            raw_store(level::info, fmt::format(fmt, std::forward<T>(args)...));
-        #endif
+    void emplace(T&&... args){
+        static_assert(storable<T...>(), "arguments are not deferrable");
+        using tuple_t = detail::deferred_tuple_t<T...>;
+        reset();
+        new (&storage) tuple_t(std::forward<T>(args)...);
+        format_fn = &format_impl<tuple_t>;
+        manage_fn = std::is_trivially_copyable<tuple_t>::value ? nullptr : &manage_impl<tuple_t>;
     }
 
-    template <class ... T>
-    void critical(source_location loc, fmt::format_string<T...> fmt, T&&... args){
-        #ifdef ALGLOG_CRITICAL_ON
-            raw_store(loc, level::critical, fmt::format(fmt, std::forward<T>(args)...));
-        #endif
+    bool empty() const {
+        return format_fn == nullptr;
     }
-    template <class ... T>
-    void critical(fmt::format_string<T...> fmt, T&&... args){
-        #ifdef ALGLOG_CRITICAL_ON
-            raw_store(level::critical, fmt::format(fmt, std::forward<T>(args)...));
-        #endif
+
+    void reset(){
+        if (format_fn && manage_fn){
+            manage_fn(op::destroy, &storage, nullptr);
+        }
+        format_fn = nullptr;
+        manage_fn = nullptr;
+    }
+
+    // 保存された引数で、フォーマット文字列fをフォーマットする。
+    void format_to(fmt::string_view f, fmt::memory_buffer& buf) const {
+        if (format_fn){
+            format_fn(f, &storage, buf);
+        }
+    }
+};
+
+// ------------------------------------
+// スレッド情報
+
+// スレッドごとのメタ情報。スレッドが最初にログを記録したときに一度だけ取得され、レジストリに登録される。
+// ログはレジストリのインデックスだけを持ち、フォーマッタが出力時に参照する。
+struct thread_info{
+    uint32_t pid = 0;
+    uint64_t os_tid = 0; // カーネルのスレッドID（Linuxではgettid）
+    std::string name; // set_thread_nameで設定された名前
+
+    // フォーマッタ向けの表記。名前があれば "name(tid)"、なければ "tid"
+    std::string label() const {
+        if (name.empty()){
+            return fmt::format("{}", os_tid);
+        }
+        return fmt::format("{}({})", name, os_tid);
+    }
+};
+
+namespace detail{
+
+    // プロセス内で共有されるスレッド情報の一覧。登録されたスレッドは削除されない。
+    class thread_registry{
+    private:
+        mutable std::mutex mtx;
+        std::deque<thread_info> entries;
+        std::atomic<uint64_t> ver{0};
+    public:
+        static thread_registry& instance(){
+            static thread_registry r;
+            return r;
+        }
+
+        uint32_t add(thread_info info){
+            std::lock_guard<std::mutex> lock(mtx);
+            entries.push_back(std::move(info));
+            ver.fetch_add(1, std::memory_order_release);
+            return static_cast<uint32_t>(entries.size() - 1);
+        }
+
+        void rename(uint32_t index, std::string_view name){
+            std::lock_guard<std::mutex> lock(mtx);
+            if (index < entries.size()){
+                entries[index].name.assign(name.data(), name.size());
+                ver.fetch_add(1, std::memory_order_release);
+            }
+        }
+
+        thread_info get(uint32_t index) const {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (index < entries.size()){
+                return entries[index];
+            }
+            return thread_info{};
+        }
+
+        // 登録・名前の変更のたびに増える。フォーマッタのキャッシュの無効化に用いる。
+        uint64_t version() const {
+            return ver.load(std::memory_order_acquire);
+        }
+    };
+
+    // fork後の子プロセスでスレッド情報を取り直すための世代番号
+    inline std::atomic<uint32_t>& fork_generation(){
+        static std::atomic<uint32_t> gen{0};
+    #if !(defined(_WIN32) || defined(_WIN64))
+        static const bool hooked = pthread_atfork(nullptr, nullptr, []{
+            fork_generation().fetch_add(1, std::memory_order_relaxed);
+        }) == 0;
+        (void)hooked;
+    #endif
+        return gen;
+    }
+
+    struct thread_slot{
+        uint32_t index = 0;
+        uint32_t pid = 0;
+        uint64_t os_tid = 0;
+        uint32_t gen = 0;
+        bool registered = false;
+    };
+
+    // 呼び出したスレッドの登録情報。初回（およびfork後の初回）のみpidとtidを取得して登録する。
+    inline const thread_slot& current_thread_slot(){
+        static thread_local thread_slot slot;
+        const auto gen = fork_generation().load(std::memory_order_relaxed);
+        if (!slot.registered || slot.gen != gen){
+            thread_info info;
+            info.pid = get_process_id();
+            info.os_tid = get_os_thread_id();
+            if (slot.registered){
+                info.name = thread_registry::instance().get(slot.index).name; // fork前の名前を引き継ぐ
+            }
+            slot.pid = info.pid;
+            slot.os_tid = info.os_tid;
+            slot.index = thread_registry::instance().add(std::move(info));
+            slot.gen = gen;
+            slot.registered = true;
+        }
+        return slot;
+    }
+
+}
+
+// 呼び出したスレッドに名前を付ける。以後のログの出力時に参照される。
+inline void set_thread_name(std::string_view name){
+    detail::thread_registry::instance().rename(detail::current_thread_slot().index, name);
+}
+
+// 呼び出したスレッドのレジストリ上のインデックス
+inline uint32_t current_thread_index(){
+    return detail::current_thread_slot().index;
+}
+
+// インデックスからスレッド情報を取得する。
+inline thread_info get_thread_info(uint32_t index){
+    return detail::thread_registry::instance().get(index);
+}
+
+// 他のプロセスやファイルから読み込んだスレッドを登録し、インデックスを返す。
+inline uint32_t register_external_thread(thread_info info){
+    return detail::thread_registry::instance().add(std::move(info));
+}
+
+// インデックスに対応するスレッドの表記（thread_info::label()）。
+// 呼び出したスレッドごとにキャッシュし、登録や名前の変更があるまでレジストリのロックも文字列の生成も行わない。
+inline const std::string& get_thread_label(uint32_t index){
+    struct label_cache{
+        uint64_t version = ~uint64_t(0);
+        std::vector<std::string> labels;
+    };
+    static thread_local label_cache cache;
+    const auto ver = detail::thread_registry::instance().version();
+    if (ver != cache.version){
+        cache.labels.clear(); // 登録や名前の変更があった
+        cache.version = ver;
+    }
+    if (index >= cache.labels.size()){
+        cache.labels.resize(index + 1);
+    }
+    auto& label = cache.labels[index];
+    if (label.empty()){
+        label = get_thread_info(index).label();
+    }
+    return label;
+}
+
+// ------------------------------------
+// メッセージ本文の格納
+
+#ifndef ALGLOG_INLINE_MESSAGE_SIZE
+    #define ALGLOG_INLINE_MESSAGE_SIZE 55 // この長さまでのメッセージはlog_t内に直接格納する（デフォルトでsizeof(log_t)が256バイトに収まる）
+#endif
+#ifndef ALGLOG_MESSAGE_POOL_CACHE
+    #define ALGLOG_MESSAGE_POOL_CACHE 64 // サイズクラスごとに保持する空きブロック数の上限
+#endif
+
+// インラインに収まらない長いメッセージ用のブロックを使い回すアロケータ。loggerごとに1つ持つ。
+// ブロックは2のべき乗のサイズクラスで管理し、返却されたブロックはクラスごとの空きリストに保持する。
+// 各ブロックは所有するプールへの参照を持つため、プールより長生きしても安全に解放できる。
+class message_pool : public std::enable_shared_from_this<message_pool>{
+private:
+    static constexpr size_t min_shift = 9; // 512byte
+    static constexpr size_t num_classes = 8; // 512byte 〜 64KB
+
+    struct free_list{
+        std::mutex mtx;
+        std::vector<void*> blocks;
+    };
+    std::array<free_list, num_classes> lists;
+
+    struct alignas(std::max_align_t) block_header{
+        std::shared_ptr<message_pool> owner; // nullptrの場合はプールを介さずに確保された
+        size_t capacity;
+    };
+
+    static size_t class_of(size_t n){
+        size_t c = 0;
+        while (c < num_classes && (size_t(1) << (min_shift + c)) < n){
+            ++c;
+        }
+        return c;
+    }
+
+    static block_header* header_of(char* data){
+        return reinterpret_cast<block_header*>(data) - 1;
+    }
+
+public:
+    message_pool() = default;
+    message_pool(const message_pool&) = delete;
+    message_pool& operator=(const message_pool&) = delete;
+    ~message_pool(){
+        for (auto& l : lists){
+            for (auto b : l.blocks){
+                ::operator delete(b);
+            }
+        }
+    }
+
+    // n文字を格納できるブロックを確保し、データ領域の先頭を返す。poolがnullptrの場合はヒープから直接確保する。
+    static char* allocate(message_pool* pool, size_t n){
+        const size_t c = class_of(n);
+        void* raw = nullptr;
+        size_t capacity = n;
+        std::shared_ptr<message_pool> owner;
+        if (pool && c < num_classes){
+            capacity = size_t(1) << (min_shift + c);
+            owner = pool->shared_from_this();
+            auto& l = pool->lists[c];
+            std::lock_guard<std::mutex> lock(l.mtx);
+            if (!l.blocks.empty()){
+                raw = l.blocks.back();
+                l.blocks.pop_back();
+            }
+        }
+        if (!raw){
+            raw = ::operator new(sizeof(block_header) + capacity);
+        }
+        auto h = new (raw) block_header{std::move(owner), capacity};
+        return reinterpret_cast<char*>(h + 1);
+    }
+
+    static void deallocate(char* data){
+        auto h = header_of(data);
+        auto owner = std::move(h->owner);
+        const size_t capacity = h->capacity;
+        h->~block_header();
+        if (owner){
+            auto& l = owner->lists[class_of(capacity)];
+            std::lock_guard<std::mutex> lock(l.mtx);
+            if (l.blocks.size() < ALGLOG_MESSAGE_POOL_CACHE){
+                l.blocks.push_back(h);
+                return;
+            }
+        }
+        ::operator delete(h);
+    }
+
+    static size_t capacity(char* data){
+        return header_of(data)->capacity;
+    }
+};
+
+// ログのメッセージ本文。
+// ALGLOG_INLINE_MESSAGE_SIZE以下のメッセージは固定長の配列に直接格納し、ヒープ確保を行わない。
+// それより長いメッセージはmessage_poolのブロックに格納する。確保済みのブロックは、収まる限り再代入時に使い回す。
+class log_message{
+private:
+    char* heap = nullptr;
+    uint32_t len = 0;
+    char local[ALGLOG_INLINE_MESSAGE_SIZE + 1];
+
+    void release(){
+        if (heap){
+            message_pool::deallocate(heap);
+            heap = nullptr;
+        }
+    }
+
+public:
+    static constexpr size_t inline_capacity = ALGLOG_INLINE_MESSAGE_SIZE;
+
+    log_message(){
+        local[0] = '\0';
+    }
+    explicit log_message(std::string_view s){
+        local[0] = '\0';
+        assign(s);
+    }
+    log_message(const log_message& o){
+        local[0] = '\0';
+        assign(o.view());
+    }
+    log_message(log_message&& o) noexcept {
+        local[0] = '\0';
+        *this = std::move(o);
+    }
+    log_message& operator=(const log_message& o){
+        if (this != &o){
+            assign(o.view());
+        }
+        return *this;
+    }
+    log_message& operator=(log_message&& o) noexcept {
+        if (this == &o){
+            return *this;
+        }
+        if (o.heap){
+            release();
+            heap = o.heap;
+            o.heap = nullptr;
+        }else{
+            std::memcpy(local, o.local, o.len + 1);
+            release();
+        }
+        len = o.len;
+        o.len = 0;
+        o.local[0] = '\0';
+        return *this;
+    }
+    log_message& operator=(std::string_view s){
+        assign(s);
+        return *this;
+    }
+    ~log_message(){
+        release();
+    }
+
+    // 本文を設定する。長いメッセージはpoolから確保する（nullptrの場合はヒープから直接確保する）。
+    void assign(const char* p, size_t n, message_pool* pool = nullptr){
+        if (n <= inline_capacity){
+            std::memcpy(local, p, n);
+            local[n] = '\0';
+            release();
+        }else if (heap && message_pool::capacity(heap) > n){
+            std::memmove(heap, p, n);
+            heap[n] = '\0';
+        }else{
+            char* b = message_pool::allocate(pool, n + 1);
+            std::memcpy(b, p, n);
+            b[n] = '\0';
+            release();
+            heap = b;
+        }
+        len = static_cast<uint32_t>(n);
+    }
+    void assign(std::string_view s, message_pool* pool = nullptr){
+        assign(s.data(), s.size(), pool);
+    }
+
+    const char* data() const { return heap ? heap : local; }
+    const char* c_str() const { return data(); }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    bool is_inline() const { return heap == nullptr; }
+    char operator[](size_t i) const { return data()[i]; }
+
+    std::string_view view() const { return std::string_view(data(), len); }
+    std::string str() const { return std::string(data(), len); }
+    operator std::string_view() const { return view(); }
+    operator std::string() const { return str(); } // 既存のsink実装との互換のため
+
+    std::string substr(size_t pos, size_t n = std::string_view::npos) const { return std::string(view().substr(pos, n)); }
+    size_t find(std::string_view s, size_t pos = 0) const { return view().find(s, pos); }
+
+    friend bool operator==(const log_message& a, std::string_view b){ return a.view() == b; }
+    friend bool operator==(std::string_view a, const log_message& b){ return a == b.view(); }
+    friend bool operator!=(const log_message& a, std::string_view b){ return a.view() != b; }
+    friend bool operator!=(std::string_view a, const log_message& b){ return a != b.view(); }
+};
+
+} // namespace alglog
+
+template <>
+struct fmt::formatter<alglog::log_message> : fmt::formatter<fmt::string_view>{
+    template <class FormatContext>
+    auto format(const alglog::log_message& m, FormatContext& ctx) const {
+        return fmt::formatter<fmt::string_view>::format(fmt::string_view(m.data(), m.size()), ctx);
+    }
+};
+
+namespace alglog{
+
+namespace detail{
+    // JSONの文字列として、引用符で囲みエスケープしてbufへ追記する。
+    // 8バイトずつ読み、エスケープが必要な文字（制御文字・'"'・'\\'）を含まない語はそのままコピーする（SWAR）。
+    inline void append_json_string(fmt::memory_buffer& buf, std::string_view s){
+        static constexpr char hex[] = "0123456789abcdef";
+        static constexpr uint64_t ones = 0x0101010101010101ull;
+        static constexpr uint64_t highs = 0x8080808080808080ull;
+        // いずれかのバイトが0であれば非0（0以外のバイトで誤検出することはあるが、見逃すことはない）
+        const auto has_zero = [](uint64_t v){ return (v - ones) & ~v & highs; };
+        buf.push_back('"');
+        const char* p = s.data();
+        const char* const end = p + s.size();
+        const char* begin = p;
+        while (p != end){
+            if (end - p >= 8){
+                uint64_t v;
+                std::memcpy(&v, p, sizeof(v));
+                const uint64_t ctrl = (v - ones * 0x20) & ~v & highs; // 0x20未満のバイト
+                if (!(ctrl | has_zero(v ^ (ones * '"')) | has_zero(v ^ (ones * '\\')))){
+                    p += 8;
+                    continue;
+                }
+            }
+            // 候補を含む語、または末尾の8バイト未満は1バイトずつ判定する
+            for (const char* w = (end - p >= 8) ? p + 8 : end; p != w; ++p){
+                const auto c = static_cast<unsigned char>(*p);
+                if (c >= 0x20 && c != '"' && c != '\\'){
+                    continue;
+                }
+                buf.append(begin, p);
+                begin = p + 1;
+                buf.push_back('\\');
+                switch (c){
+                    case '"': buf.push_back('"'); break;
+                    case '\\': buf.push_back('\\'); break;
+                    case '\n': buf.push_back('n'); break;
+                    case '\r': buf.push_back('r'); break;
+                    case '\t': buf.push_back('t'); break;
+                    default:
+                        buf.append(std::string_view("u00"));
+                        buf.push_back(hex[c >> 4]);
+                        buf.push_back(hex[c & 0xF]);
+                        break;
+                }
+            }
+        }
+        buf.append(begin, end);
+        buf.push_back('"');
+    }
+
+    // JSONの数値として追記する。JSONで表せない値（NaN・無限大）はnullとする。
+    inline void append_json_number(fmt::memory_buffer& buf, double v){
+        if (!std::isfinite(v)){
+            buf.append(std::string_view("null"));
+            return;
+        }
+        fmt::format_to(std::back_inserter(buf), "{}", v);
+    }
+}
+
+// 構造化ログのフィールド。キーと値（整数・浮動小数点数・真偽値・文字列）の組。
+// 値は文字列に整形せず型付きのまま保持され、json_formatter等で出力の際に直接書き出される。
+struct field{
+    enum class kind : uint8_t{ integer, unsigned_integer, floating, boolean, string };
+    std::string_view key;
+    kind type;
+    union{
+        int64_t i;
+        uint64_t u;
+        double d;
+        bool b;
+    };
+    std::string_view str;
+
+    template <class T, typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, int>::type = 0>
+    field(std::string_view key, T v) : key(key), type(kind::integer), i(v) {}
+    template <class T, typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value && !std::is_same<T, bool>::value, int>::type = 0>
+    field(std::string_view key, T v) : key(key), type(kind::unsigned_integer), u(v) {}
+    field(std::string_view key, double v) : key(key), type(kind::floating), d(v) {}
+    field(std::string_view key, bool v) : key(key), type(kind::boolean), b(v) {}
+    field(std::string_view key, std::string_view v) : key(key), type(kind::string), u(0), str(v) {}
+    field(std::string_view key, const char* v) : field(key, std::string_view(v)) {}
+    field(std::string_view key, const std::string& v) : field(key, std::string_view(v)) {}
+
+    // 値をJSONとしてbufへ追記する。
+    void append_json_value(fmt::memory_buffer& buf) const {
+        switch (type){
+            case kind::integer: { const fmt::format_int f(i); buf.append(f.data(), f.data() + f.size()); break; }
+            case kind::unsigned_integer: { const fmt::format_int f(u); buf.append(f.data(), f.data() + f.size()); break; }
+            case kind::floating: detail::append_json_number(buf, d); break;
+            case kind::boolean: buf.append(b ? std::string_view("true") : std::string_view("false")); break;
+            case kind::string: detail::append_json_string(buf, str); break;
+        }
+    }
+
+    // "key":value の形でbufへ追記する。
+    void append_to(fmt::memory_buffer& buf) const {
+        detail::append_json_string(buf, key);
+        buf.push_back(':');
+        append_json_value(buf);
+    }
+};
+
+// ログに付与するフィールドの一覧。ログ出力の関数に、フォーマット文字列の前に渡す。
+// 例 : lgr->info(alglog::fields{{"user", id}, {"path", path}}, "request done in {} ms", ms);
+using fields = std::initializer_list<field>;
+
+// log_tに保持されるフィールド。キーと値を型付きのまま1つの連続領域にエンコードして持つ。
+// 1件のエンコードは type(1byte) / キー長(2byte) / キー / 値（数値は8byte、真偽値は1byte、文字列は長さ(4byte)と本文）。
+// 連続領域のため、バイトリングバッファや共有メモリへはそのままコピーできる。
+class log_fields{
+private:
+    char* heap = nullptr;
+    uint32_t len = 0;
+
+    void release(){
+        if (heap){
+            message_pool::deallocate(heap);
+            heap = nullptr;
+        }
+        len = 0;
+    }
+
+    static size_t key_size(std::string_view key){
+        return std::min<size_t>(key.size(), std::numeric_limits<uint16_t>::max());
+    }
+    static size_t str_size(std::string_view str){
+        return std::min<size_t>(str.size(), std::numeric_limits<uint32_t>::max());
+    }
+
+    static size_t encoded_size(const field& f){
+        size_t n = 1 + sizeof(uint16_t) + key_size(f.key);
+        switch (f.type){
+            case field::kind::boolean: return n + 1;
+            case field::kind::string: return n + sizeof(uint32_t) + str_size(f.str);
+            default: return n + sizeof(uint64_t);
+        }
+    }
+
+    template <class T>
+    static char* put(char* p, const T& v){
+        std::memcpy(p, &v, sizeof(T));
+        return p + sizeof(T);
+    }
+    static char* put(char* p, std::string_view s){
+        std::memcpy(p, s.data(), s.size());
+        return p + s.size();
+    }
+
+public:
+    log_fields() = default;
+    log_fields(const log_fields& o){
+        assign(o.blob());
+    }
+    log_fields(log_fields&& o) noexcept : heap(o.heap), len(o.len) {
+        o.heap = nullptr;
+        o.len = 0;
+    }
+    log_fields& operator=(const log_fields& o){
+        if (this != &o){
+            assign(o.blob());
+        }
+        return *this;
+    }
+    log_fields& operator=(log_fields&& o) noexcept {
+        if (this != &o){
+            release();
+            heap = o.heap;
+            len = o.len;
+            o.heap = nullptr;
+            o.len = 0;
+        }
+        return *this;
+    }
+    ~log_fields(){
+        release();
+    }
+
+    // フィールドの一覧をエンコードして保持する。
+    void assign(fields fs, message_pool* pool = nullptr){
+        size_t n = 0;
+        for (const auto& f : fs){
+            n += encoded_size(f);
+        }
+        char* p = reserve(n, pool);
+        if (!p){
+            return;
+        }
+        for (const auto& f : fs){
+            p = put(p, static_cast<uint8_t>(f.type));
+            p = put(p, static_cast<uint16_t>(key_size(f.key)));
+            p = put(p, f.key.substr(0, key_size(f.key)));
+            switch (f.type){
+                case field::kind::boolean: p = put(p, static_cast<uint8_t>(f.b)); break;
+                case field::kind::string:
+                    p = put(p, static_cast<uint32_t>(str_size(f.str)));
+                    p = put(p, f.str.substr(0, str_size(f.str)));
+                    break;
+                default: p = put(p, f.u); break; // 共用体の8byteをそのままコピーする
+            }
+        }
+    }
+
+    // エンコード済みの領域をそのまま保持する（コンテナ間のコピー用）。
+    void assign(std::string_view encoded, message_pool* pool = nullptr){
+        if (char* p = reserve(encoded.size(), pool)){
+            std::memcpy(p, encoded.data(), encoded.size());
+        }
+    }
+
+    // n byteの領域を確保して返す。n == 0であれば空にしてnullptrを返す。
+    char* reserve(size_t n, message_pool* pool = nullptr){
+        if (n == 0 || n > std::numeric_limits<uint32_t>::max()){
+            release();
+            return nullptr;
+        }
+        if (!heap || message_pool::capacity(heap) < n){
+            release();
+            heap = message_pool::allocate(pool, n);
+        }
+        len = static_cast<uint32_t>(n);
+        return heap;
+    }
+
+    void clear(){
+        release();
+    }
+
+    bool empty() const { return len == 0; }
+
+    // エンコード済みの領域
+    std::string_view blob() const { return std::string_view(heap, len); }
+
+    // 各フィールドについてf(const field&)を呼ぶ。fieldのキーと文字列はこのオブジェクトの領域を参照する。
+    template <class F>
+    void for_each(F&& f) const {
+        const char* p = heap;
+        const char* const end = heap + len;
+        while (p < end){
+            uint8_t type;
+            uint16_t klen;
+            std::memcpy(&type, p, 1);
+            std::memcpy(&klen, p + 1, sizeof(klen));
+            p += 1 + sizeof(klen);
+            const std::string_view key(p, klen);
+            p += klen;
+            switch (static_cast<field::kind>(type)){
+                case field::kind::boolean:
+                    f(field(key, *p != 0));
+                    p += 1;
+                    break;
+                case field::kind::string: {
+                    uint32_t slen;
+                    std::memcpy(&slen, p, sizeof(slen));
+                    p += sizeof(slen);
+                    f(field(key, std::string_view(p, slen)));
+                    p += slen;
+                    break;
+                }
+                default: {
+                    field v(key, uint64_t(0));
+                    v.type = static_cast<field::kind>(type);
+                    std::memcpy(&v.u, p, sizeof(uint64_t));
+                    f(v);
+                    p += sizeof(uint64_t);
+                    break;
+                }
+            }
+        }
+    }
+};
+
+// トレーススパンの開始・終了を表すログの付加情報。通常のログではphaseが0となる。
+struct span_info{
+    char phase = 0; // 'B' : 開始 / 'E' : 終了
+    uint16_t name_len = 0; // msgの先頭name_lenバイトがスパン名。以降は " " に続けてJSONの引数が入る
+    uint32_t depth = 0; // スレッド内での入れ子の深さ（最外側が0）
+    uint64_t id = 0; // スレッド内で一意なID（上位32bitはスレッドレジストリのインデックス+1）
+    uint64_t parent = 0; // 親スパンのID。最外側なら0
+
+    bool is_span() const {
+        return phase != 0;
+    }
+};
+
+// ログクラス
+struct log_t{
+    log_message msg;
+    level lvl;
+    std::chrono::time_point<std::chrono::system_clock> time;
+    uint32_t pid;
+    uint32_t thread = 0; // スレッドレジストリのインデックス。get_thread_infoでtidや名前を取得できる。
+    source_location loc;
+    deferred_format args; // 遅延フォーマットモードでのみ利用される。msgにフォーマット文字列が入っており、flush時にmsgへ展開される。
+    span_info span; // trace_spanが記録したログでのみ設定される
+    log_fields fields; // fieldsを渡したログでのみ設定される
+
+    // 遅延フォーマットされた引数があれば、msgへ展開する。
+    void resolve(message_pool* pool = nullptr){
+        if (args.empty()){
+            return;
+        }
+        fmt::memory_buffer buf;
+        try{
+            args.format_to(fmt::string_view(msg.data(), msg.size()), buf);
+            msg.assign(buf.data(), buf.size(), pool);
+        }catch(const fmt::format_error& e){
+            msg = fmt::format("[alglog] deferred format error : {}", e.what());
+        }
+        args.reset();
+    }
+
+    std::string_view level_str() const {
+        if (lvl == level::error){
+            return " ERR";
+        }
+        if (lvl == level::alert){
+            return "ALRT";
+        }
+        if (lvl == level::info){
+            return "INFO";
+        }
+        if (lvl == level::critical){
+            return "CRIT";
+        }
+        if (lvl == level::warn){
+            return "WARN";
+        }
+        if (lvl == level::debug){
+            return " DBG";
+        }
+        if (lvl == level::trace){
+            return "TRCE";
+        }
+        return "----";
+    }
+
+    std::string get_level_str() const {
+        return std::string(level_str());
+    }
+
+    thread_info get_thread() const {
+        return get_thread_info(thread);
+    }
+};
+
+
+// 連続したログ列への軽量な参照（C++20のstd::spanの代替）
+template <class T>
+class span{
+private:
+    T* ptr = nullptr;
+    size_t len = 0;
+public:
+    constexpr span() = default;
+    constexpr span(T* ptr, size_t len) : ptr(ptr), len(len) {}
+    template <class U>
+    span(std::vector<U>& v) : ptr(v.data()), len(v.size()) {}
+    constexpr T* data() const { return ptr; }
+    constexpr size_t size() const { return len; }
+    constexpr bool empty() const { return len == 0; }
+    constexpr T* begin() const { return ptr; }
+    constexpr T* end() const { return ptr + len; }
+    constexpr T& operator[](size_t i) const { return ptr[i]; }
+    constexpr span subspan(size_t offset, size_t count) const { return span(ptr + offset, count); }
+};
+
+// ------------------------------------
+// Log収集用コンテナ
+
+// alglogで用いるログコンテナのインターフェース。
+// 任意の実装を利用可能だが、スレッドセーフ or ロックフリーの実装を推奨する。
+class log_container_interface{
+public:
+    // ログを追加する。追加に成功したらtrueを返す。
+    // ログはコンテナへムーブされる（失敗した場合は変更されない）。ブロック不可。
+    virtual bool push(log_t&&) = 0;
+
+    // ログを取り出す。取り出しに成功したらtrueを返す。
+    // ログは引数へムーブされる。ブロック不可。
+    virtual bool pop(log_t&) = 0;
+
+    // メタ情報とメッセージ本文を分けてログを追加する。headのmsgは無視される。
+    // 長いメッセージはpoolから確保される。
+    // 本文を直接シリアライズできるコンテナは、これをオーバーライドしてメッセージの構築を省略できる。
+    virtual bool push_message(log_t&& head, std::string_view msg, message_pool* pool){
+        head.msg.assign(msg, pool);
+        return push(std::move(head));
+    }
+
+    // 最大n個のログをoutへまとめて取り出し、取り出した数を返す。
+    // outの要素は上書きされる（msgの確保領域は再利用される）。ブロック不可。
+    virtual size_t pop_n(log_t* out, size_t n){
+        size_t i = 0;
+        while (i < n && pop(out[i])){
+            ++i;
+        }
+        return i;
+    }
+
+    // コンテナ内部で破棄したログの累計数（上書き等、pushが成功扱いとなった破棄のみ）。
+    // pushの失敗による破棄はlogger側で数える。
+    virtual uint64_t dropped() const {
+        return 0;
+    }
+
+    // このコンテナに積んだログを、同じloggerが取り出すか。
+    // 別のプロセスが取り出すコンテナ（log_container_shmのproducer）はfalseを返し、loggerはflushを起こさなくなる。
+    virtual bool drains_locally() const {
+        return true;
+    }
+
+    virtual ~log_container_interface(){}
+};
+
+
+// std::listとmtxを使った簡易スレッドセーフ実装。
+// ほぼ無限に書き込めるが、ロックが長く低速。
+// 取り出し済みのノードは最大ALGLOG_LIST_NODE_CACHE個まで保持し、次のpushで再利用する。
+#ifndef ALGLOG_LIST_NODE_CACHE
+    #define ALGLOG_LIST_NODE_CACHE 1024
+#endif
+
+class log_container_std_list : public log_container_interface{
+private:
+    std::list<log_t> c;
+    std::list<log_t> free_nodes; // 再利用待ちのノード
+    mutable std::mutex mtx;
+
+    // ノードをfree_nodesへ戻す。上限を超える分は解放する。
+    void recycle_front(){
+        if (free_nodes.size() < ALGLOG_LIST_NODE_CACHE){
+            free_nodes.splice(free_nodes.end(), c, c.begin());
+        }else{
+            c.pop_front();
+        }
+    }
+
+public:
+    bool push(log_t&& l) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (free_nodes.empty()){
+            c.push_back(std::move(l));
+        }else{
+            c.splice(c.end(), free_nodes, free_nodes.begin());
+            c.back() = std::move(l);
+        }
+        return true;
+    }
+    bool pop(log_t& l) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (c.empty()){
+            return false;
+        }
+        l = std::move(c.front());
+        recycle_front();
+        return true;
+    }
+    size_t pop_n(log_t* out, size_t n) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        size_t i = 0;
+        for (; i < n && !c.empty(); ++i){
+            out[i] = std::move(c.front());
+            recycle_front();
+        }
+        return i;
+    }
+};
+
+// リングバッファが満杯のときの振る舞い
+enum class overflow_policy{
+    drop_newest, // 書き込もうとしたログを破棄する（デフォルト）
+    overwrite_oldest, // 最も古いログを破棄して書き込む
+    block, // 一定回数スピンした後、上限時間まで待機する。それでも空かなければ破棄する。
+    spill // 溢れた分をmutexつきの無制限キューに退避する
+};
+
+#ifndef ALGLOG_MPSC_BLOCK_SPIN
+    #define ALGLOG_MPSC_BLOCK_SPIN 64
+#endif
+#ifndef ALGLOG_MPSC_BLOCK_TIMEOUT_US
+    #define ALGLOG_MPSC_BLOCK_TIMEOUT_US 10000
+#endif
+
+// multi producer / single consumer のリングバッファ。
+// 容量に制限があり、内容量に関わらずメモリを消費する。
+// ロックフリーで比較的高速。制限を超えた場合の振る舞いはPで選択する。
+template <size_t N, overflow_policy P = overflow_policy::drop_newest>
+class log_container_mpsc : public log_container_interface{
+private:
+    mpsc_ring_buffer<log_t, N> c;
+    std::atomic<uint64_t> overwritten{0};
+
+    // overwrite_oldest : producerが古いログを取り出すため、consumer側を排他する
+    std::atomic_flag consumer_lock = ATOMIC_FLAG_INIT;
+
+    // spill : 溢れたログの退避先
+    std::list<log_t> spill;
+    std::mutex spill_mtx;
+    std::atomic<bool> spilling{false};
+
+    void lock_consumer(){
+        while (consumer_lock.test_and_set(std::memory_order_acquire)){
+            std::this_thread::yield();
+        }
+    }
+    void unlock_consumer(){
+        consumer_lock.clear(std::memory_order_release);
+    }
+
+public:
+    // リングへのpushは失敗時にlをムーブしないため、再試行してよい。
+    bool push(log_t&& l) override {
+        if constexpr (P == overflow_policy::drop_newest){
+            return c.push(std::move(l));
+        }else if constexpr (P == overflow_policy::overwrite_oldest){
+            while (!c.push(std::move(l))){
+                log_t oldest;
+                lock_consumer();
+                if (c.pop(oldest)){
+                    overwritten.fetch_add(1, std::memory_order_relaxed);
+                }
+                unlock_consumer();
+            }
+            return true;
+        }else if constexpr (P == overflow_policy::block){
+            for (int i = 0; i < ALGLOG_MPSC_BLOCK_SPIN; ++i){
+                if (c.push(std::move(l))){
+                    return true;
+                }
+                std::this_thread::yield();
+            }
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(ALGLOG_MPSC_BLOCK_TIMEOUT_US);
+            while (std::chrono::steady_clock::now() < deadline){
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+                if (c.push(std::move(l))){
+                    return true;
+                }
+            }
+            return false;
+        }else{
+            // 退避中はリングへ書き込まず、順序を保つ
+            if (!spilling.load(std::memory_order_acquire) && c.push(std::move(l))){
+                return true;
+            }
+            std::lock_guard<std::mutex> lock(spill_mtx);
+            spill.push_back(std::move(l));
+            spilling.store(true, std::memory_order_release);
+            return true;
+        }
+    }
+
+    bool pop(log_t& l) override {
+        if constexpr (P == overflow_policy::overwrite_oldest){
+            lock_consumer();
+            const bool ret = c.pop(l);
+            unlock_consumer();
+            return ret;
+        }else if constexpr (P == overflow_policy::spill){
+            if (c.pop(l)){
+                return true;
+            }
+            if (!spilling.load(std::memory_order_acquire)){
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(spill_mtx);
+            if (spill.empty()){
+                return false;
+            }
+            l = std::move(spill.front());
+            spill.pop_front();
+            if (spill.empty()){
+                spilling.store(false, std::memory_order_release);
+            }
+            return true;
+        }else{
+            return c.pop(l);
+        }
+    }
+
+    uint64_t dropped() const override {
+        return overwritten.load(std::memory_order_relaxed);
+    }
+};
+
+// スレッドごとの single producer / single consumer リングバッファ。
+// 各スレッドは最初の書き込み時に自分専用のリングを登録し、共有変数へのCASなしに書き込む。
+// 取り出し時は全リングの先頭を比較し、タイムスタンプ順にマージして返す。
+// 容量はスレッドごとのもので、制限を超える分は書込みに失敗する。
+// スレッド終了時にリングは退役扱いとなり、残りのログを取り出した後に解放される。
+template <size_t N>
+class log_container_per_thread : public log_container_interface{
+private:
+    struct ring{
+        spsc_ring_buffer<log_t, N> q;
+        std::atomic<bool> retired{false}; // producerスレッドが終了した
+        std::atomic<bool> orphaned{false}; // コンテナが破棄された
+    };
+
+    // スレッドローカルに保持する、コンテナごとのリング一覧
+    struct thread_rings{
+        std::vector<std::pair<uint64_t, std::shared_ptr<ring>>> v;
+        uint64_t last_id = 0;
+        ring* last = nullptr;
+        ~thread_rings(){
+            for (auto& e : v){
+                e.second->retired.store(true, std::memory_order_release);
+            }
+        }
+    };
+
+    static uint64_t next_id(){
+        static std::atomic<uint64_t> id{0};
+        return ++id;
+    }
+
+    const uint64_t id = next_id();
+    std::mutex registry_mtx; // リング登録時のみ利用する
+    std::vector<std::shared_ptr<ring>> registry; // 登録済みリング（registry_mtxで保護）
+    std::atomic<uint64_t> registry_gen{0};
+    std::vector<std::shared_ptr<ring>> rings; // consumer専用のスナップショット
+    uint64_t rings_gen = 0;
+
+    ring* local_ring(){
+        static thread_local thread_rings tr;
+        if (tr.last_id == id){
+            return tr.last;
+        }
+        for (auto& e : tr.v){
+            if (e.first == id){
+                tr.last_id = id;
+                tr.last = e.second.get();
+                return tr.last;
+            }
+        }
+        // 破棄済みコンテナのリングを掃除してから新規登録する
+        tr.v.erase(std::remove_if(tr.v.begin(), tr.v.end(), [](const std::pair<uint64_t, std::shared_ptr<ring>>& e){
+            return e.second->orphaned.load(std::memory_order_acquire);
+        }), tr.v.end());
+        auto r = std::make_shared<ring>();
+        {
+            std::lock_guard<std::mutex> lock(registry_mtx);
+            registry.push_back(r);
+            registry_gen.fetch_add(1, std::memory_order_release);
+        }
+        tr.v.emplace_back(id, r);
+        tr.last_id = id;
+        tr.last = r.get();
+        return tr.last;
+    }
+
+    void refresh_rings(){
+        const auto gen = registry_gen.load(std::memory_order_acquire);
+        if (gen == rings_gen){
+            return;
+        }
+        std::lock_guard<std::mutex> lock(registry_mtx);
+        rings = registry;
+        rings_gen = registry_gen.load(std::memory_order_relaxed);
+    }
+
+    void remove_ring(const std::shared_ptr<ring>& r){
+        std::lock_guard<std::mutex> lock(registry_mtx);
+        registry.erase(std::remove(registry.begin(), registry.end(), r), registry.end());
+        registry_gen.fetch_add(1, std::memory_order_release);
+    }
+
+public:
+    ~log_container_per_thread(){
+        std::lock_guard<std::mutex> lock(registry_mtx);
+        for (auto& r : registry){
+            r->orphaned.store(true, std::memory_order_release);
+        }
+    }
+
+    bool push(log_t&& l) override {
+        return local_ring()->q.push(std::move(l));
+    }
+
+    bool pop(log_t& l) override {
+        refresh_rings();
+        ring* oldest = nullptr;
+        const log_t* oldest_front = nullptr;
+        for (size_t i = 0; i < rings.size();){
+            auto& r = rings[i];
+            // 退役フラグを先に確認する。退役後に空であれば、以後書き込まれることはない。
+            const bool retired = r->retired.load(std::memory_order_acquire);
+            const log_t* f = r->q.front();
+            if (!f){
+                if (retired){
+                    remove_ring(r);
+                    rings.erase(rings.begin() + i);
+                    continue;
+                }
+            }else if (!oldest_front || f->time < oldest_front->time){
+                oldest = r.get();
+                oldest_front = f;
+            }
+            ++i;
+        }
+        if (!oldest){
+            return false;
+        }
+        return oldest->q.pop(l);
+    }
+};
+
+// 可変長レコードの multi producer / single consumer バイトリングバッファ。
+// メタ情報とメッセージ本文をインラインでシリアライズし、レコードごとに必要なバイト数だけを消費する。
+// 書き込み時にヒープ確保を行わない。容量を超える分は書込みに失敗する。
+// 1レコードの上限（容量の1/4）を超えるメッセージは切り詰められ、末尾に truncated_marker が付与される。
+template <size_t N>
+class log_container_mpsc_bytes : public log_container_interface{
+private:
+    struct record_head{
+        level lvl;
+        uint32_t pid;
+        std::chrono::system_clock::rep time;
+        uint32_t thread;
+        source_location loc;
+        span_info span;
+        uint32_t msg_len;
+        uint32_t fields_len; // メッセージ本文の後ろに続くフィールドのバイト数
+        bool has_args;
+    };
+
+    using buffer_t = byte_ring_buffer<N>;
+
+    static constexpr size_t args_offset = (sizeof(record_head) + alignof(deferred_format) - 1) & ~(alignof(deferred_format) - 1);
+    static_assert(alignof(deferred_format) <= buffer_t::align, "deferred_format alignment exceeds record alignment");
+
+    buffer_t c;
+
+    bool serialize(log_t& head, std::string_view msg){
+        const bool has_args = !head.args.empty();
+        const size_t msg_offset = has_args ? args_offset + sizeof(deferred_format) : sizeof(record_head);
+        std::string_view fs = head.fields.blob();
+        if (msg_offset + fs.size() + truncated_marker.size() > buffer_t::max_payload){
+            fs = std::string_view(); // フィールドだけで上限を超える場合は、フィールドを破棄する
+        }
+        size_t len = msg.size();
+        bool truncated = false;
+        if (msg_offset + fs.size() + len > buffer_t::max_payload){
+            len = buffer_t::max_payload - msg_offset - fs.size();
+            truncated = true;
+        }
+        auto p = static_cast<unsigned char*>(c.reserve(msg_offset + len + fs.size()));
+        if (!p){
+            return false;
+        }
+        auto h = new (p) record_head{head.lvl, head.pid, head.time.time_since_epoch().count(), head.thread, head.loc, head.span,
+            static_cast<uint32_t>(len), static_cast<uint32_t>(fs.size()), has_args};
+        if (has_args){
+            new (p + args_offset) deferred_format(std::move(head.args));
+        }
+        if (truncated){
+            const size_t keep = len - truncated_marker.size();
+            std::memcpy(p + msg_offset, msg.data(), keep);
+            std::memcpy(p + msg_offset + keep, truncated_marker.data(), truncated_marker.size());
+        }else{
+            std::memcpy(p + msg_offset, msg.data(), len);
+        }
+        if (!fs.empty()){
+            std::memcpy(p + msg_offset + len, fs.data(), fs.size());
+        }
+        (void)h;
+        c.commit(p);
+        return true;
+    }
+
+public:
+    static constexpr std::string_view truncated_marker = " ...[truncated]";
+
+    ~log_container_mpsc_bytes(){
+        log_t tmp;
+        while (pop(tmp)) {}
+    }
+
+    bool push(log_t&& l) override {
+        return serialize(l, l.msg);
+    }
+
+    bool push_message(log_t&& head, std::string_view msg, message_pool*) override {
+        return serialize(head, msg);
+    }
+
+    bool pop(log_t& l) override {
+        size_t n;
+        auto p = static_cast<unsigned char*>(c.front(n));
+        if (!p){
+            return false;
+        }
+        auto h = reinterpret_cast<record_head*>(p);
+        l.lvl = h->lvl;
+        l.pid = h->pid;
+        l.time = std::chrono::system_clock::time_point(std::chrono::system_clock::duration(h->time));
+        l.thread = h->thread;
+        l.loc = h->loc;
+        l.span = h->span;
+        size_t msg_offset = sizeof(record_head);
+        if (h->has_args){
+            auto a = reinterpret_cast<deferred_format*>(p + args_offset);
+            l.args = std::move(*a);
+            a->~deferred_format();
+            msg_offset = args_offset + sizeof(deferred_format);
+        }else{
+            l.args.reset();
+        }
+        l.msg.assign(reinterpret_cast<const char*>(p + msg_offset), h->msg_len);
+        l.fields.assign(std::string_view(reinterpret_cast<const char*>(p + msg_offset + h->msg_len), h->fields_len));
+        h->~record_head();
+        c.release();
+        return true;
+    }
+};
+
+#if !(defined(_WIN32) || defined(_WIN64))
+
+#ifndef ALGLOG_SHM_RINGBUFFER_SIZE
+    #define ALGLOG_SHM_RINGBUFFER_SIZE (1024 * 1024 * 4)
+#endif
+
+// 共有メモリ上のリングバッファの役割
+enum class shm_role{
+    producer, // ログを積む（アプリケーションのプロセス）
+    consumer // ログを取り出す（alglog-collector等、1つのプロセスのみ）
+};
+
+// 名前付きのPOSIX共有メモリ上に置いた、複数プロセスから書き込める可変長MPSCリングバッファ（byte_ring_buffer）。
+// 同じホストの複数のプロセスが1つのリングへログを積み、1つのconsumerプロセスがまとめて取り出してsinkへ出力する。
+// producerのloggerはflushを行わないため、ログ1件あたりのコストはリングへのコピーのみとなる。
+//
+// レコードはポインタを含まない形にシリアライズされる（ソース位置・メッセージは文字列としてコピー）。
+// consumerはpidとOSのスレッドIDからスレッドレジストリへ外部スレッドとして登録し、ソース位置の文字列は保持し続ける。
+// 遅延フォーマットの引数は、producer側で展開してから書き込む。
+// ALGLOG_TSC_CLOCKを用いる場合は、producerとconsumerの両方で有効にすること（時刻はTSCの生値のまま渡される）。
+//
+// 共有メモリは最初に開いたプロセスが作成し、削除はremove()で明示的に行う。
+// 書き込み途中のproducerが異常終了すると、consumerはそのレコード以降を取り出せなくなる。
+//
+// 例 : auto lgr = std::make_shared<alglog::logger>(std::make_unique<alglog::log_container_shm<>>("/myapp", alglog::shm_role::producer));
+template <size_t N = ALGLOG_SHM_RINGBUFFER_SIZE>
+class log_container_shm : public log_container_interface{
+private:
+    static constexpr char magic[8] = {'A','L','G','L','O','G','S','H'};
+    static constexpr uint32_t version = 1;
+
+    struct layout{
+        char magic[8];
+        uint32_t version;
+        std::atomic<uint32_t> ready;
+        uint64_t capacity;
+        byte_ring_buffer<N> ring;
+    };
+
+    struct record_head{
+        int64_t time;
+        uint64_t os_tid;
+        uint64_t span_id;
+        uint64_t span_parent;
+        uint32_t pid;
+        int32_t line;
+        uint32_t span_depth;
+        uint32_t msg_len;
+        uint32_t fields_len;
+        uint16_t file_len;
+        uint16_t func_len;
+        uint16_t span_name_len;
+        uint8_t lvl;
+        char span_phase;
+    };
+
+    const std::string name;
+    const shm_role role;
+    layout* shm = nullptr;
+
+    // consumer側 : pid・スレッドIDとレジストリのインデックスの対応、ソース位置の文字列
+    std::unordered_map<uint64_t, uint32_t> threads;
+    std::unordered_map<std::string, std::unique_ptr<std::string>> strings;
+
+    static uint16_t clamp16(size_t n){
+        return static_cast<uint16_t>(std::min<size_t>(n, std::numeric_limits<uint16_t>::max()));
+    }
+
+    bool open_or_create(){
+        static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<size_t>::is_always_lock_free, "shared memory requires lock-free atomics");
+        bool created = true;
+        int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd < 0 && errno == EEXIST){
+            created = false;
+            fd = ::shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0600);
+        }
+        if (fd < 0){
+            return false;
+        }
+        bool sized = false;
+        if (created){
+            sized = ::ftruncate(fd, static_cast<off_t>(sizeof(layout))) == 0;
+        }else{
+            // 作成したプロセスが領域を確保するまで待つ
+            for (int i = 0; i < 1000 && !sized; ++i){
+                struct stat st;
+                sized = ::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(layout);
+                if (!sized){
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+        }
+        void* p = sized ? ::mmap(nullptr, sizeof(layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (p == MAP_FAILED){
+            return false;
+        }
+        auto l = static_cast<layout*>(p);
+        if (created){
+            new (&l->ring) byte_ring_buffer<N>();
+            std::memcpy(l->magic, magic, sizeof(magic));
+            l->version = version;
+            l->capacity = N;
+            l->ready.store(1, std::memory_order_release);
+        }else{
+            for (int i = 0; i < 1000 && l->ready.load(std::memory_order_acquire) == 0; ++i){
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            if (l->ready.load(std::memory_order_acquire) == 0 || std::memcmp(l->magic, magic, sizeof(magic)) != 0
+                || l->version != version || l->capacity != N){
+                ::munmap(p, sizeof(layout));
+                return false;
+            }
+        }
+        shm = l;
+        return true;
+    }
+
+    bool serialize(log_t& head, std::string_view msg){
+        if (!shm){
+            return false;
+        }
+        if (!head.args.empty()){
+            head.resolve(); // 引数は他のプロセスへ渡せないため、ここで展開する
+            msg = head.msg;
+        }
+        const auto& ts = detail::current_thread_slot();
+        record_head h{};
+        h.time = static_cast<int64_t>(head.time.time_since_epoch().count());
+        h.os_tid = ts.os_tid;
+        h.span_id = head.span.id;
+        h.span_parent = head.span.parent;
+        h.pid = head.pid;
+        h.line = head.loc.line;
+        h.span_depth = head.span.depth;
+        h.file_len = clamp16(std::strlen(head.loc.file));
+        h.func_len = clamp16(std::strlen(head.loc.func));
+        h.span_name_len = head.span.name_len;
+        h.lvl = static_cast<uint8_t>(head.lvl);
+        h.span_phase = head.span.phase;
+        std::string_view fs = head.fields.blob();
+        size_t fixed = sizeof(record_head) + h.file_len + h.func_len;
+        if (fixed + fs.size() > byte_ring_buffer<N>::max_payload){
+            fs = std::string_view(); // フィールドだけで上限を超える場合は、フィールドを破棄する
+        }
+        fixed += fs.size();
+        h.fields_len = static_cast<uint32_t>(fs.size());
+        const size_t room = byte_ring_buffer<N>::max_payload > fixed ? byte_ring_buffer<N>::max_payload - fixed : 0;
+        h.msg_len = static_cast<uint32_t>(std::min(msg.size(), room));
+
+        auto rec = static_cast<char*>(shm->ring.reserve(fixed + h.msg_len));
+        if (!rec){
+            return false;
+        }
+        char* p = rec;
+        std::memcpy(p, &h, sizeof(h));
+        p += sizeof(h);
+        std::memcpy(p, head.loc.file, h.file_len);
+        p += h.file_len;
+        std::memcpy(p, head.loc.func, h.func_len);
+        p += h.func_len;
+        std::memcpy(p, msg.data(), h.msg_len);
+        p += h.msg_len;
+        if (!fs.empty()){
+            std::memcpy(p, fs.data(), fs.size());
+        }
+        shm->ring.commit(rec);
+        return true;
+    }
+
+    const char* intern(std::string_view s){
+        auto it = strings.find(std::string(s));
+        if (it == strings.end()){
+            auto str = std::make_unique<std::string>(s);
+            it = strings.emplace(*str, std::move(str)).first;
+        }
+        return it->second->c_str();
+    }
+
+    uint32_t thread_index(uint32_t pid, uint64_t os_tid){
+        const uint64_t key = (static_cast<uint64_t>(pid) << 32) ^ os_tid;
+        auto it = threads.find(key);
+        if (it == threads.end()){
+            thread_info info;
+            info.pid = pid;
+            info.os_tid = os_tid;
+            it = threads.emplace(key, register_external_thread(std::move(info))).first;
+        }
+        return it->second;
+    }
+
+public:
+    log_container_shm(std::string shm_name, shm_role role) : name(std::move(shm_name)), role(role) {
+        open_or_create();
+    }
+    log_container_shm(const log_container_shm&) = delete;
+    log_container_shm& operator=(const log_container_shm&) = delete;
+    ~log_container_shm(){
+        if (shm){
+            ::munmap(shm, sizeof(layout));
+        }
+    }
+
+    // 共有メモリを開けたか
+    bool is_open() const {
+        return shm != nullptr;
+    }
+
+    // 名前付き共有メモリを削除する。開いているプロセスは、それぞれが閉じるまで古い領域を使い続ける。
+    static bool remove(const std::string& shm_name){
+        return ::shm_unlink(shm_name.c_str()) == 0;
+    }
+
+    bool push(log_t&& l) override {
+        return serialize(l, l.msg);
+    }
+
+    bool push_message(log_t&& head, std::string_view msg, message_pool*) override {
+        return serialize(head, msg);
+    }
+
+    bool pop(log_t& l) override {
+        if (!shm || role != shm_role::consumer){
+            return false;
+        }
+        size_t n;
+        auto p = static_cast<const char*>(shm->ring.front(n));
+        if (!p){
+            return false;
+        }
+        record_head h;
+        std::memcpy(&h, p, sizeof(h));
+        p += sizeof(h);
+        const std::string_view file(p, h.file_len);
+        const std::string_view func(p + h.file_len, h.func_len);
+        l.msg.assign(p + h.file_len + h.func_len, h.msg_len);
+        l.fields.assign(std::string_view(p + h.file_len + h.func_len + h.msg_len, h.fields_len));
+        l.lvl = static_cast<level>(h.lvl);
+        l.pid = h.pid;
+        l.time = std::chrono::system_clock::time_point(std::chrono::system_clock::duration(h.time));
+        l.thread = thread_index(h.pid, h.os_tid);
+        l.loc = source_location{intern(file), h.line, intern(func)};
+        l.args.reset();
+        l.span.phase = h.span_phase;
+        l.span.name_len = h.span_name_len;
+        l.span.depth = h.span_depth;
+        l.span.id = h.span_id;
+        l.span.parent = h.span_parent;
+        shm->ring.release();
+        return true;
+    }
+
+    bool drains_locally() const override {
+        return role == shm_role::consumer;
+    }
+};
+#endif
+
+#if defined(ALGLOG_CONTAINER_MPSC_RINGBUFFER)
+    #if !defined (ALGLOG_MPSC_RINGBUFFER_SIZE)
+        #define ALGLOG_MPSC_RINGBUFFER_SIZE (1024 * 16)
+    #endif
+    #if !defined (ALGLOG_MPSC_OVERFLOW_POLICY)
+        #define ALGLOG_MPSC_OVERFLOW_POLICY drop_newest
+    #endif
+    using log_container_t = log_container_mpsc<ALGLOG_MPSC_RINGBUFFER_SIZE, overflow_policy::ALGLOG_MPSC_OVERFLOW_POLICY>;
+#elif defined(ALGLOG_CONTAINER_BYTE_RINGBUFFER)
+    #if defined (ALGLOG_BYTE_RINGBUFFER_SIZE)
+        using log_container_t = log_container_mpsc_bytes<ALGLOG_BYTE_RINGBUFFER_SIZE>;
+    #else
+        using log_container_t = log_container_mpsc_bytes<1024 * 1024>;
+    #endif
+#elif defined(ALGLOG_CONTAINER_SPSC_PER_THREAD)
+    #if defined (ALGLOG_SPSC_RINGBUFFER_SIZE)
+        using log_container_t = log_container_per_thread<ALGLOG_SPSC_RINGBUFFER_SIZE>;
+    #else
+        using log_container_t = log_container_per_thread<1024 * 2>;
+    #endif
+#else
+    // default
+    using log_container_t = log_container_std_list;
+#endif
+
+// ------------------------------------
+// パターンフォーマッタ
+
+// 出力先のバッファへ直接書き込むフォーマッタ
+using buffer_formatter_t = std::function<void(const log_t&, fmt::memory_buffer&)>;
+
+// パターン文字列を一度だけ解析し、命令列としてバッファへ書き込むフォーマッタ。
+// 日時部分は秒単位でキャッシュされ、同じ秒のログでは再計算しない。
+//
+//   %Y %m %d %H %M %S : 年(4桁) 月 日 時 分 秒(2桁)    %e : ミリ秒(3桁)    %f : マイクロ秒(6桁)
+//   %l : レベル    %v : メッセージ    %P : プロセスID    %t : スレッド（名前があれば "name(tid)"）
+//   %s : ファイル名    %# : 行番号    %! : 関数名    %k : フィールド（"key=value"を空白区切り）    %% : '%'
+//
+// '%'の直後に幅を指定すると右寄せ、'-'と幅を指定すると左寄せでパディングする（例 : %8P, %-4#）。
+// 日時はデフォルトでローカル時刻。utc = trueでUTCになる。
+//
+// 例 : pattern_formatter("%Y-%m-%d %H:%M:%S.%f [%l] %v")
+class pattern_formatter{
+private:
+    enum class kind{ literal, time_block, millisec, microsec, level, message, pid, tid, file, line, func, fields };
+    struct op{
+        kind k;
+        int width = 0;
+        bool left = false;
+        std::string text; // literal : 文字列、time_block : 日時のパターン
+        std::string cache; // time_block : 秒ごとの描画結果
+        explicit op(kind k) : k(k) {}
+    };
+    std::vector<op> ops;
+    bool utc;
+    int64_t cached_sec = std::numeric_limits<int64_t>::min();
+    std::vector<std::string> thread_labels; // スレッドのインデックスごとの表記のキャッシュ
+    uint64_t thread_labels_version = 0;
+
+    static bool is_time_spec(char c){
+        return c == 'Y' || c == 'm' || c == 'd' || c == 'H' || c == 'M' || c == 'S';
+    }
+
+    static void pad(fmt::memory_buffer& buf, size_t len, int width){
+        for (size_t i = len; i < static_cast<size_t>(width); ++i){
+            buf.push_back(' ');
+        }
+    }
+
+    static void append_aligned(fmt::memory_buffer& buf, std::string_view v, int width, bool left){
+        if (!left){
+            pad(buf, v.size(), width);
+        }
+        buf.append(v.data(), v.data() + v.size());
+        if (left){
+            pad(buf, v.size(), width);
+        }
+    }
+
+    template <class Int>
+    static void append_int(fmt::memory_buffer& buf, Int v, int width, bool left){
+        const fmt::format_int f(v);
+        append_aligned(buf, std::string_view(f.data(), f.size()), width, left);
+    }
+
+    // 0埋めの固定桁数で書き込む
+    static void append_digits(fmt::memory_buffer& buf, unsigned v, int digits){
+        char tmp[10];
+        for (int i = digits - 1; i >= 0; --i){
+            tmp[i] = static_cast<char>('0' + v % 10);
+            v /= 10;
+        }
+        buf.append(tmp, tmp + digits);
+    }
+
+    void render_time_blocks(int64_t sec){
+        const auto t = static_cast<std::time_t>(sec);
+        const std::tm tm = utc ? fmt::gmtime(t) : fmt::localtime(t);
+        for (auto& o : ops){
+            if (o.k != kind::time_block){
+                continue;
+            }
+            fmt::memory_buffer b;
+            for (size_t i = 0; i < o.text.size(); ++i){
+                if (o.text[i] != '%' || i + 1 == o.text.size()){
+                    b.push_back(o.text[i]);
+                    continue;
+                }
+                switch (o.text[++i]){
+                    case 'Y': append_digits(b, static_cast<unsigned>(tm.tm_year + 1900), 4); break;
+                    case 'm': append_digits(b, static_cast<unsigned>(tm.tm_mon + 1), 2); break;
+                    case 'd': append_digits(b, static_cast<unsigned>(tm.tm_mday), 2); break;
+                    case 'H': append_digits(b, static_cast<unsigned>(tm.tm_hour), 2); break;
+                    case 'M': append_digits(b, static_cast<unsigned>(tm.tm_min), 2); break;
+                    case 'S': append_digits(b, static_cast<unsigned>(tm.tm_sec), 2); break;
+                    default: break;
+                }
+            }
+            o.cache.assign(b.data(), b.size());
+        }
+        cached_sec = sec;
+    }
+
+    // "key=value"を空白区切りで書き込む。空白・'"'・'='・制御文字を含む文字列はJSONの文字列として引用符で囲む。
+    static void append_fields(fmt::memory_buffer& buf, const log_fields& fs){
+        bool first = true;
+        fs.for_each([&](const field& f){
+            if (!first){
+                buf.push_back(' ');
+            }
+            first = false;
+            buf.append(f.key.data(), f.key.data() + f.key.size());
+            buf.push_back('=');
+            const bool quote = f.type == field::kind::string && (f.str.empty()
+                || std::any_of(f.str.begin(), f.str.end(), [](char c){ return static_cast<unsigned char>(c) <= ' ' || c == '"' || c == '='; }));
+            if (f.type == field::kind::string && !quote){
+                buf.append(f.str.data(), f.str.data() + f.str.size());
+            }else{
+                f.append_json_value(buf);
+            }
+        });
+    }
+
+    const std::string& thread_label(uint32_t index){
+        const auto ver = detail::thread_registry::instance().version();
+        if (ver != thread_labels_version){
+            thread_labels.clear(); // 登録や名前の変更があった
+            thread_labels_version = ver;
+        }
+        if (index >= thread_labels.size()){
+            thread_labels.resize(index + 1);
+        }
+        auto& label = thread_labels[index];
+        if (label.empty()){
+            label = get_thread_info(index).label();
+        }
+        return label;
+    }
+
+    void compile(std::string_view pattern){
+        // 日時指定子と、それらに挟まれたリテラルは1つのtime_blockにまとめる
+        std::string pending_literal;
+        auto flush_literal = [&]{
+            if (!pending_literal.empty()){
+                if (!ops.empty() && ops.back().k == kind::literal){
+                    ops.back().text += pending_literal;
+                }else{
+                    op o(kind::literal);
+                    o.text = pending_literal;
+                    ops.push_back(std::move(o));
+                }
+                pending_literal.clear();
+            }
+        };
+        for (size_t i = 0; i < pattern.size(); ++i){
+            const char c = pattern[i];
+            if (c != '%' || i + 1 == pattern.size()){
+                pending_literal.push_back(c);
+                continue;
+            }
+            ++i;
+            bool left = false;
+            int width = 0;
+            if (pattern[i] == '-'){
+                left = true;
+                ++i;
+            }
+            while (i < pattern.size() && pattern[i] >= '0' && pattern[i] <= '9'){
+                width = width * 10 + (pattern[i] - '0');
+                ++i;
+            }
+            if (i == pattern.size()){
+                break;
+            }
+            const char spec = pattern[i];
+            if (spec == '%'){
+                pending_literal.push_back('%');
+                continue;
+            }
+            if (is_time_spec(spec)){
+                if (!ops.empty() && ops.back().k == kind::time_block){
+                    ops.back().text += pending_literal; // 日時の間のリテラルはブロックに含める
+                    pending_literal.clear();
+                }else{
+                    flush_literal();
+                    ops.emplace_back(kind::time_block);
+                }
+                ops.back().text += '%';
+                ops.back().text += spec;
+                continue;
+            }
+            kind k;
+            switch (spec){
+                case 'e': k = kind::millisec; break;
+                case 'f': k = kind::microsec; break;
+                case 'l': k = kind::level; break;
+                case 'v': k = kind::message; break;
+                case 'P': k = kind::pid; break;
+                case 't': k = kind::tid; break;
+                case 's': k = kind::file; break;
+                case '#': k = kind::line; break;
+                case '!': k = kind::func; break;
+                case 'k': k = kind::fields; break;
+                default:
+                    pending_literal.push_back('%');
+                    pending_literal.push_back(spec);
+                    continue;
+            }
+            flush_literal();
+            op o(k);
+            o.width = width;
+            o.left = left;
+            ops.push_back(std::move(o));
+        }
+        flush_literal();
+    }
+
+public:
+    explicit pattern_formatter(std::string_view pattern, bool utc = false) : utc(utc) {
+        compile(pattern);
+    }
+
+    void operator()(const log_t& l, fmt::memory_buffer& buf){
+        const auto since = l.time.time_since_epoch();
+        const auto sec = std::chrono::duration_cast<std::chrono::seconds>(since);
+        if (sec.count() != cached_sec){
+            render_time_blocks(sec.count());
+        }
+        for (const auto& o : ops){
+            switch (o.k){
+                case kind::literal:
+                    buf.append(o.text.data(), o.text.data() + o.text.size());
+                    break;
+                case kind::time_block:
+                    buf.append(o.cache.data(), o.cache.data() + o.cache.size());
+                    break;
+                case kind::millisec:
+                    append_digits(buf, static_cast<unsigned>(std::chrono::duration_cast<std::chrono::milliseconds>(since - sec).count()), 3);
+                    break;
+                case kind::microsec:
+                    append_digits(buf, static_cast<unsigned>(std::chrono::duration_cast<std::chrono::microseconds>(since - sec).count()), 6);
+                    break;
+                case kind::level:
+                    append_aligned(buf, l.level_str(), o.width, o.left);
+                    break;
+                case kind::message:
+                    append_aligned(buf, l.msg, o.width, o.left);
+                    break;
+                case kind::pid:
+                    append_int(buf, l.pid, o.width, o.left);
+                    break;
+                case kind::tid:
+                    append_aligned(buf, thread_label(l.thread), o.width, o.left);
+                    break;
+                case kind::file:
+                    append_aligned(buf, l.loc.file, o.width, o.left);
+                    break;
+                case kind::line:
+                    append_int(buf, l.loc.line, o.width, o.left);
+                    break;
+                case kind::func:
+                    append_aligned(buf, l.loc.func, o.width, o.left);
+                    break;
+                case kind::fields:
+                    append_fields(buf, l.fields);
+                    break;
+            }
+        }
+    }
+
+    // sink::formatterとしても使えるよう、文字列を返す版も用意する
+    std::string operator()(const log_t& l){
+        fmt::memory_buffer buf;
+        (*this)(l, buf);
+        return std::string(buf.data(), buf.size());
+    }
+};
+
+// ログを1行のJSONオブジェクトとして書き込むフォーマッタ（JSON Lines）。ログ収集基盤へ、行を正規表現で解析せずに取り込める。
+// 時刻はUTCのISO 8601（マイクロ秒まで）で、日時部分は秒単位でキャッシュされる。
+// fieldsを渡したログでは、"fields"にフィールドを型付きのまま書き出す（数値は数値、真偽値はtrue/falseとなる）。
+// "thread"はスレッドに名前がある場合のみ、"file"・"line"・"func"はソース位置がある場合のみ出力される。
+//
+// 例 : {"time":"2024-01-02T03:04:05.123456Z","level":"info","pid":10,"tid":12,"file":"main.cpp","line":42,"func":"run","msg":"done","fields":{"user":7}}
+class json_formatter{
+private:
+    int64_t cached_sec = std::numeric_limits<int64_t>::min();
+    char cached_time[19] = {}; // "YYYY-MM-DDTHH:MM:SS"（終端なし）
+    std::vector<std::string> thread_keys; // スレッドのインデックスごとの ,"tid":...,"thread":... のキャッシュ
+    uint64_t thread_keys_version = 0;
+
+    static std::string_view level_name(level lvl){
+        switch (lvl){
+            case level::error: return "error";
+            case level::alert: return "alert";
+            case level::info: return "info";
+            case level::critical: return "critical";
+            case level::warn: return "warn";
+            case level::debug: return "debug";
+            case level::trace: return "trace";
+            default: return "unknown";
+        }
+    }
+
+    template <class Int>
+    static void append_int(fmt::memory_buffer& buf, Int v){
+        const fmt::format_int f(v);
+        buf.append(f.data(), f.data() + f.size());
+    }
+
+    static void put_digits(char* p, unsigned v, int digits){
+        for (int i = digits - 1; i >= 0; --i){
+            p[i] = static_cast<char>('0' + v % 10);
+            v /= 10;
+        }
+    }
+
+    void render_time(int64_t sec){
+        const std::tm tm = fmt::gmtime(static_cast<std::time_t>(sec));
+        put_digits(cached_time, static_cast<unsigned>(tm.tm_year + 1900), 4);
+        cached_time[4] = '-';
+        put_digits(cached_time + 5, static_cast<unsigned>(tm.tm_mon + 1), 2);
+        cached_time[7] = '-';
+        put_digits(cached_time + 8, static_cast<unsigned>(tm.tm_mday), 2);
+        cached_time[10] = 'T';
+        put_digits(cached_time + 11, static_cast<unsigned>(tm.tm_hour), 2);
+        cached_time[13] = ':';
+        put_digits(cached_time + 14, static_cast<unsigned>(tm.tm_min), 2);
+        cached_time[16] = ':';
+        put_digits(cached_time + 17, static_cast<unsigned>(tm.tm_sec), 2);
+        cached_sec = sec;
+    }
+
+    const std::string& thread_key(uint32_t index){
+        const auto ver = detail::thread_registry::instance().version();
+        if (ver != thread_keys_version){
+            thread_keys.clear(); // 登録や名前の変更があった
+            thread_keys_version = ver;
+        }
+        if (index >= thread_keys.size()){
+            thread_keys.resize(index + 1);
+        }
+        auto& key = thread_keys[index];
+        if (key.empty()){
+            const auto info = get_thread_info(index);
+            fmt::memory_buffer b;
+            fmt::format_to(std::back_inserter(b), ",\"tid\":{}", info.os_tid);
+            if (!info.name.empty()){
+                b.append(std::string_view(",\"thread\":"));
+                detail::append_json_string(b, info.name);
+            }
+            key.assign(b.data(), b.size());
+        }
+        return key;
+    }
+
+public:
+    void operator()(const log_t& l, fmt::memory_buffer& buf){
+        const auto since = l.time.time_since_epoch();
+        const auto sec = std::chrono::duration_cast<std::chrono::seconds>(since);
+        if (sec.count() != cached_sec){
+            render_time(sec.count());
+        }
+        char frac[8] = {'.'};
+        put_digits(frac + 1, static_cast<unsigned>(std::chrono::duration_cast<std::chrono::microseconds>(since - sec).count()), 6);
+        frac[7] = 'Z';
+
+        buf.append(std::string_view("{\"time\":\""));
+        buf.append(cached_time, cached_time + sizeof(cached_time));
+        buf.append(frac, frac + sizeof(frac));
+        buf.append(std::string_view("\",\"level\":\""));
+        buf.append(level_name(l.lvl));
+        buf.append(std::string_view("\",\"pid\":"));
+        append_int(buf, l.pid);
+        buf.append(thread_key(l.thread));
+        if (l.loc.line != 0){
+            buf.append(std::string_view(",\"file\":"));
+            detail::append_json_string(buf, l.loc.file);
+            buf.append(std::string_view(",\"line\":"));
+            append_int(buf, l.loc.line);
+            buf.append(std::string_view(",\"func\":"));
+            detail::append_json_string(buf, l.loc.func);
+        }
+        buf.append(std::string_view(",\"msg\":"));
+        detail::append_json_string(buf, l.msg);
+        if (!l.fields.empty()){
+            buf.append(std::string_view(",\"fields\":"));
+            char sep = '{';
+            l.fields.for_each([&](const field& f){
+                buf.push_back(sep);
+                sep = ',';
+                f.append_to(buf);
+            });
+            buf.push_back('}');
+        }
+        buf.push_back('}');
+    }
+
+    // sink::formatterとしても使えるよう、文字列を返す版も用意する
+    std::string operator()(const log_t& l){
+        fmt::memory_buffer buf;
+        (*this)(l, buf);
+        return std::string(buf.data(), buf.size());
+    }
+};
+
+// ------------------------------------
+// Core
+
+// sinkの計測値のスナップショット。sink::stats()で取得する。
+struct sink_stats{
+    uint64_t records = 0; // output / output_batchへ渡したログの数
+    uint64_t rejected = 0; // accepted_levels、valveにより出力しなかったログの数
+    uint64_t bytes = 0; // 書き出したバイト数（書き込み先を持つbuiltinのsinkのみ）
+    uint64_t errors = 0; // 書き込みの失敗等の数（同上）
+};
+
+struct sink{
+    level_mask accepted_levels = all_levels; // 受け付けるレベル。loggerはこれを集計し、どのsinkも受け付けないレベルのログを記録時点で破棄する。
+    std::function<bool(const log_t&)> valve = nullptr; // データを出力するかを判断する関数。nullptrの場合は全て出力する。
+    std::function<std::string(const log_t&)> formatter = nullptr; // sinkはformatterを持ち、出力の際に利用する。
+    buffer_formatter_t buffer_formatter = nullptr; // 設定されている場合、formatterより優先してバッファへ直接書き込む。
+    virtual void output(const log_t&) = 0; // ログ出力のタイミングで接続されているloggerからこのoutputが呼び出される。
+
+    // buffer_formatter、なければformatterを用いてbufへ整形結果を追記する。
+    void format_to(const log_t& l, fmt::memory_buffer& buf){
+        if (buffer_formatter){
+            buffer_formatter(l, buf);
+            return;
+        }
+        const auto s = formatter(l);
+        buf.append(s.data(), s.data() + s.size());
+    }
+
+    // 複数のログをまとめて出力する。flush時は基本的にこちらが呼ばれる。
+    // デフォルト実装はoutputを繰り返し呼ぶ。まとめて書き込めるsinkはオーバーライドすると良い。
+    virtual void output_batch(span<const log_t> ls){
+        for (const auto& l : ls){
+            output(l);
+        }
+    }
+
+    // 計測値を取得する。どのスレッドから呼んでも良い。
+    sink_stats stats() const {
+        sink_stats st;
+        st.records = stat_records.load(std::memory_order_relaxed);
+        st.rejected = stat_rejected.load(std::memory_order_relaxed);
+        st.bytes = stat_bytes.load(std::memory_order_relaxed);
+        st.errors = stat_errors.load(std::memory_order_relaxed);
+        return st;
+    }
+
+    bool _accepts(const log_t& l) const {
+        return (accepted_levels & level_bit(l.lvl)) && (!valve || valve(l));
+    }
+
+    void _cond_output(const log_t& l){
+        if (_accepts(l)){
+            stat_records.fetch_add(1, std::memory_order_relaxed);
+            output(l);
+        }else{
+            stat_rejected.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // accepted_levelsとvalveを通過した連続区間ごとにoutput_batchを呼ぶ。
+    void _cond_output_batch(span<const log_t> ls){
+        if (!valve && accepted_levels == all_levels){
+            stat_records.fetch_add(ls.size(), std::memory_order_relaxed);
+            output_batch(ls);
+            return;
+        }
+        size_t begin = 0;
+        size_t rejected = 0;
+        for (size_t i = 0; i < ls.size(); ++i){
+            if (!_accepts(ls[i])){
+                if (begin < i){
+                    output_batch(ls.subspan(begin, i - begin));
+                }
+                begin = i + 1;
+                ++rejected;
+            }
+        }
+        if (begin < ls.size()){
+            output_batch(ls.subspan(begin, ls.size() - begin));
+        }
+        stat_records.fetch_add(ls.size() - rejected, std::memory_order_relaxed);
+        stat_rejected.fetch_add(rejected, std::memory_order_relaxed);
+    }
+    virtual ~sink(){}
+
+protected:
+    // 書き込み先を持つsinkは、書き出したバイト数と失敗をこれらで報告する。
+    void count_bytes(uint64_t n){
+        stat_bytes.fetch_add(n, std::memory_order_relaxed);
+    }
+    void count_error(){
+        stat_errors.fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> stat_records{0};
+    std::atomic<uint64_t> stat_rejected{0};
+    std::atomic<uint64_t> stat_bytes{0};
+    std::atomic<uint64_t> stat_errors{0};
+};
+
+// TSCの値をsystem_clockの時刻に変換する。
+// 初回の生成時にのみ短時間のキャリブレーションを行い、その結果を全loggerで共有する。
+// 以後recalibrate()を呼ぶたびに初回からの長い基線で周波数を補正し、オフセットをsystem_clockに合わせ直す。
+// 変換・再キャリブレーションはconsumer（flushするスレッド）からのみ呼ぶこと。
+class tsc_clock{
+private:
+    struct sample{
+        uint64_t tsc;
+        int64_t ns;
+    };
+    struct calibration{
+        bool enabled;
+        sample anchor; // 周波数計算の基準点
+        sample base; // 変換の基準点
+        double ns_per_tick;
+    };
+    const bool enabled;
+    sample anchor{};
+    sample base{};
+    double ns_per_tick = 0.0;
+    std::chrono::steady_clock::time_point last_calibration;
+
+    static int64_t system_ns(){
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    static sample take_sample(){
+        // system_clockの読み取りを挟む2回のTSCの中点を用いる
+        const auto t0 = read_tsc();
+        const auto ns = system_ns();
+        const auto t1 = read_tsc();
+        return sample{t0 + (t1 - t0) / 2, ns};
+    }
+
+    // 初回のキャリブレーション結果。ビジーウェイトを伴うため、プロセス内で一度だけ行う。
+    static const calibration& initial(){
+        static const calibration c = []{
+            calibration r{tsc_available(), {}, {}, 0.0};
+            if (!r.enabled){
+                return r;
+            }
+            r.anchor = take_sample();
+            const auto until = std::chrono::steady_clock::now() + initial_calibration;
+            while (std::chrono::steady_clock::now() < until) {}
+            r.base = take_sample();
+            r.ns_per_tick = static_cast<double>(r.base.ns - r.anchor.ns) / static_cast<double>(r.base.tsc - r.anchor.tsc);
+            return r;
+        }();
+        return c;
+    }
+
+public:
+    static constexpr std::chrono::milliseconds initial_calibration{2};
+    static constexpr std::chrono::milliseconds recalibration_interval{1000};
+
+    tsc_clock() : enabled(initial().enabled) {
+        const auto& c = initial();
+        anchor = c.anchor;
+        base = c.base;
+        ns_per_tick = c.ns_per_tick;
+        last_calibration = std::chrono::steady_clock::now();
+    }
+
+    // TSCが利用可能か。falseの場合はsystem_clockを用いる。
+    bool is_enabled() const {
+        return enabled;
+    }
+
+    // producer側の時刻取得。TSCの生値をtime_pointに詰めて返す（to_wall()で変換するまで時刻としては無意味）。
+    std::chrono::system_clock::time_point now() const {
+        if (!enabled){
+            return std::chrono::system_clock::now();
+        }
+        return std::chrono::system_clock::time_point(std::chrono::system_clock::duration(static_cast<std::chrono::system_clock::rep>(read_tsc())));
+    }
+
+    // now()で得た値をsystem_clockの時刻に変換する。
+    std::chrono::system_clock::time_point to_wall(std::chrono::system_clock::time_point raw) const {
+        if (!enabled){
+            return raw;
+        }
+        const auto tsc = static_cast<uint64_t>(raw.time_since_epoch().count());
+        const double diff = (tsc >= base.tsc) ? static_cast<double>(tsc - base.tsc) : -static_cast<double>(base.tsc - tsc);
+        const auto ns = base.ns + static_cast<int64_t>(diff * ns_per_tick);
+        return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(ns)));
+    }
+
+    // 前回から一定時間が経過していれば再キャリブレーションする。
+    void recalibrate(){
+        if (!enabled){
+            return;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        if (now - last_calibration < recalibration_interval){
+            return;
+        }
+        base = take_sample();
+        if (base.tsc > anchor.tsc){
+            ns_per_tick = static_cast<double>(base.ns - anchor.ns) / static_cast<double>(base.tsc - anchor.tsc);
+        }
+        last_calibration = now;
+    }
+};
+
+// flush時に一度にコンテナから取り出すログの数
+#ifndef ALGLOG_FLUSH_BATCH_SIZE
+    #define ALGLOG_FLUSH_BATCH_SIZE 256
+#endif
+
+#ifndef ALGLOG_FLUSHER_HIGH_WATERMARK
+    #define ALGLOG_FLUSHER_HIGH_WATERMARK 1024 // 未出力のログがこの数に達するとflusherを起こす
+#endif
+
+namespace detail{
+
+    // loggerとflusherの間で共有される起床通知。
+    // flusherはwait_forで眠り、producerは未出力数が閾値を超えたときやerrorレベルのログを積んだときにnotifyする。
+    class flush_signal{
+    private:
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool requested = false;
+        std::atomic<bool> pending{false}; // 既に通知済みであれば、producerはロックを取らずに済む
+    public:
+        std::atomic<bool> active{false}; // flusherが待機しているときのみtrue
+        std::atomic<size_t> high_watermark{ALGLOG_FLUSHER_HIGH_WATERMARK};
+
+        void notify(){
+            if (pending.exchange(true, std::memory_order_acq_rel)){
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                requested = true;
+            }
+            cv.notify_one();
+        }
+
+        // 通知されるか、timeoutが経過するまで待機する。通知で起きた場合はtrueを返す。
+        template <class Rep, class Period>
+        bool wait_for(std::chrono::duration<Rep, Period> timeout){
+            std::unique_lock<std::mutex> lock(mtx);
+            const bool notified = cv.wait_for(lock, timeout, [&]{ return requested; });
+            requested = false;
+            pending.store(false, std::memory_order_release);
+            return notified;
+        }
+    };
+
+}
+
+// loggerの計測値のスナップショット。logger::telemetry()で取得する。
+struct logger_telemetry{
+    static constexpr size_t flush_buckets = 16;
+    uint64_t enqueued = 0; // コンテナへ積んだログの数
+    uint64_t dropped = 0; // 容量超過等により破棄されたログの数
+    uint64_t pending = 0; // 未出力のログのおおよその数
+    uint64_t max_depth = 0; // flush開始時点での未出力数の最大値
+    uint64_t flushes = 0; // drainを行った回数
+    uint64_t flush_ns_total = 0;
+    uint64_t flush_ns_max = 0;
+    // drainの所要時間のヒストグラム。0番目は1us未満、i番目は[2^(i-1), 2^i)us、最後の要素は上限なし。
+    std::array<uint64_t, flush_buckets> flush_histogram{};
+    std::vector<sink_stats> sinks; // 接続順
+};
+
+class logger{
+private:
+    std::shared_ptr<message_pool> pool = std::make_shared<message_pool>(); // 長いメッセージの格納用
+    std::unique_ptr<log_container_interface> logs;
+    bool local_drain = true; // logsのdrains_locally()
+    // loggerは自分が持っているsink全てに入力されたlogを受け渡す。
+    // sinkの一覧は変更されない共有のスナップショットで、接続・切断のたびに新しい一覧に差し替えられる。
+    // flush側はロックを取らずに読み、sink_readersで読み取り中であることを示す。
+    using sink_list = std::vector<std::shared_ptr<sink>>;
+    std::atomic<const sink_list*> sinks{new sink_list()};
+    std::atomic<uint32_t> sink_readers{0};
+    std::mutex sinks_mtx; // 一覧の差し替えを直列化する
+    std::vector<std::unique_ptr<const sink_list>> retired_sinks; // 差し替え済みで、まだ読み手が残っている可能性のある一覧
+    std::atomic<uint64_t> push_failed{0}; // コンテナへの書き込みに失敗した数
+    uint64_t drop_reported = 0; // flush時に報告済みの破棄数
+    std::vector<log_t> batch; // flush時にまとめて取り出すためのバッファ
+    std::atomic<level_mask> threshold{all_levels}; // set_levelで指定された実行時閾値
+    std::atomic<level_mask> enabled{all_levels}; // threshold と sinkが受け付けるレベルの積。記録時に最初に確認される。
+    std::atomic<uint64_t> pushed{0}; // コンテナへの書き込みに成功した数
+    std::atomic<uint64_t> popped{0}; // flushで取り出した数
+    std::shared_ptr<detail::flush_signal> signal = std::make_shared<detail::flush_signal>();
+    std::atomic<bool> combining{false}; // drainを行っているスレッドがあればtrue
+    std::atomic<uint64_t> pass_started{0}; // 開始したdrainの回数
+    std::atomic<uint64_t> pass_done{0}; // 完了したdrainの番号
+    std::atomic<std::thread::id> combiner{}; // drainを行っているスレッド
+    bool reentered = false; // drain中のsinkからflushが呼ばれた（combinerのスレッドのみが触る）
+    // 計測値。書き込むのはdrainを行うスレッドのみ
+    std::atomic<uint64_t> max_depth{0};
+    std::atomic<uint64_t> flushes{0};
+    std::atomic<uint64_t> flush_ns_total{0};
+    std::atomic<uint64_t> flush_ns_max{0};
+    std::array<std::atomic<uint64_t>, logger_telemetry::flush_buckets> flush_histogram{};
+    std::atomic<int64_t> report_interval_ms{0}; // 0で定期報告なし
+    std::chrono::steady_clock::time_point last_report = std::chrono::steady_clock::now();
+#ifdef ALGLOG_TSC_CLOCK
+    tsc_clock clock;
+#endif
+
+    // 時刻・プロセス・スレッド情報を付与してコンテナに積む。
+    // すべてのログ出力はこのpush_logを通る。
+    void push_log(log_t&& log){
+        stamp(log);
+        const auto lvl = log.lvl;
+        after_push(lvl, logs->push(std::move(log)));
+    }
+
+    // メッセージ本文を別に渡す版。短いメッセージはlog_t内に、長いメッセージはpoolのブロックに格納される。
+    void push_log(log_t&& log, std::string_view msg){
+        stamp(log);
+        const auto lvl = log.lvl;
+        after_push(lvl, logs->push_message(std::move(log), msg, pool.get()));
+    }
+
+    void stamp(log_t& log){
+    #ifdef ALGLOG_TSC_CLOCK
+        log.time = clock.now(); // TSCの生値。flush時に時刻へ変換される。
+    #else
+        log.time = std::chrono::system_clock::now();
+    #endif
+        const auto& ts = detail::current_thread_slot(); // pidとtidはスレッドごとにキャッシュされている
+        log.pid = ts.pid;
+        log.thread = ts.index;
+    }
+
+    void after_push(level lvl, bool pushed_ok){
+        if (pushed_ok){
+            pushed.fetch_add(1, std::memory_order_relaxed);
+        }else{
+            push_failed.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (!local_drain){
+            return; // 別のプロセスが取り出す
+        }
+        if (!async_mode){
+            flush();
+            return;
+        }
+        // flusherが待機中であれば、重要なログや溜まりすぎたログがあるときだけ起こす
+        if (signal->active.load(std::memory_order_relaxed)){
+            if (lvl == level::error || lvl == level::critical || !pushed_ok
+                || pending_count() >= signal->high_watermark.load(std::memory_order_relaxed)){
+                signal->notify();
+            }
+        }
+    }
+
+    // フォーマットしてログを保管する。
+    // 遅延フォーマットモードで、かつ引数が遅延可能な型のみで構成される場合は、引数のコピーだけを保管する。
+    template <class ... T>
+    void store(source_location loc, const level lvl, fmt::format_string<T...> fmt, T&&... args){
+        store(loc, lvl, fields{}, fmt, std::forward<T>(args)...);
+    }
+
+    // フィールドを付与する版。フィールドは整形せず、型付きのままlog_t::fieldsへコピーする。
+    template <class ... T>
+    void store(source_location loc, const level lvl, fields fs, fmt::format_string<T...> fmt, T&&... args){
+        if (!is_enabled(lvl)){
+            return; // フォーマットもコンテナへの書き込みも行わない
+        }
+        store_impl(std::integral_constant<bool, deferred_format::storable<T...>()>{}, loc, lvl, fs, fmt, std::forward<T>(args)...);
+    }
+
+    template <class ... T>
+    void store_impl(std::true_type, source_location loc, const level lvl, fields fs, fmt::format_string<T...> fmt, T&&... args){
+        if (!deferred_mode){
+            store_impl(std::false_type{}, loc, lvl, fs, fmt, std::forward<T>(args)...);
+            return;
+        }
+        log_t log;
+        log.lvl = lvl;
+        log.loc = loc;
+        const fmt::string_view f(fmt);
+        log.msg.assign(f.data(), f.size(), pool.get()); // fmt::runtimeの一時的な文字列でも良いよう、フォーマット文字列はコピーする
+        log.args.emplace(std::forward<T>(args)...);
+        if (fs.size() != 0){
+            log.fields.assign(fs, pool.get());
+        }
+        push_log(std::move(log));
+    }
+
+    template <class ... T>
+    void store_impl(std::false_type, source_location loc, const level lvl, fields fs, fmt::format_string<T...> fmt, T&&... args){
+        fmt::memory_buffer buf;
+        fmt::format_to(std::back_inserter(buf), fmt, std::forward<T>(args)...);
+        log_t log;
+        log.lvl = lvl;
+        log.loc = loc;
+        if (fs.size() != 0){
+            log.fields.assign(fs, pool.get());
+        }
+        push_log(std::move(log), std::string_view(buf.data(), buf.size()));
+    }
+
+public:
+    const bool async_mode; // 非同期モードフラグ。非同期モードでは手動でflushする必要がある。同期モードではログ記録と同時に自動的にflush()が呼ばれる。
+    static constexpr size_t flush_batch_size = ALGLOG_FLUSH_BATCH_SIZE;
+    const bool deferred_mode; // 遅延フォーマットフラグ。非同期モードでのみ有効。フォーマットをflush()側で行い、ログ記録時は引数のコピーのみを行う。
+    logger(bool async_mode = false, bool deferred_mode = false) : logger(std::make_unique<log_container_t>(), async_mode, deferred_mode) {}
+    // コンテナを指定して生成する（例 : log_container_shm）。
+    logger(std::unique_ptr<log_container_interface> container, bool async_mode = false, bool deferred_mode = false)
+        : logs(std::move(container)), async_mode(async_mode), deferred_mode(async_mode && deferred_mode) {
+        local_drain = logs->drains_locally();
+    }
+    ~logger(){
+        flush(); // 終了時に必ずフラッシュする
+        signal->notify(); // flusherが待機していれば、終了を知らせる
+        delete sinks.load();
+    }
+
+    void connect_sink(std::shared_ptr<sink> s){
+        {
+            std::lock_guard<std::mutex> lock(sinks_mtx);
+            auto next = std::make_unique<sink_list>(*sinks.load());
+            next->push_back(std::move(s));
+            publish_sinks(std::move(next), false);
+        }
+        update_level_mask();
+    }
+
+    // sinkを切り離す。実行中のflushが古い一覧を使い終えるまで待ってから戻るため、
+    // 戻った後はこのloggerからsへ出力されることはない。接続されていなければfalseを返す。
+    // sinkの出力中（output内）から呼んではならない。
+    bool disconnect_sink(const std::shared_ptr<sink>& s){
+        {
+            std::lock_guard<std::mutex> lock(sinks_mtx);
+            const auto& current = *sinks.load();
+            auto it = std::find(current.begin(), current.end(), s);
+            if (it == current.end()){
+                return false;
+            }
+            auto next = std::make_unique<sink_list>(current.begin(), it);
+            next->insert(next->end(), std::next(it), current.end());
+            publish_sinks(std::move(next), true);
+        }
+        update_level_mask();
+        return true;
+    }
+
+    // ------------------------------------
+    // 実行時のレベル閾値
+
+    // lvlより重要度の低いログを記録時点で破棄する。
+    void set_level(level lvl){
+        set_level_mask(levels_up_to(lvl));
+    }
+
+    // 記録するレベルをマスクで指定する。
+    void set_level_mask(level_mask mask){
+        threshold.store(mask, std::memory_order_relaxed);
+        update_level_mask();
+    }
+
+    // 接続されているsinkのaccepted_levelsから有効なレベルを再計算する。
+    // 接続後にsink::accepted_levelsを変更した場合は、これを呼ぶ。
+    // sinkが1つも接続されていない場合は、後から接続されるsinkのために全てのレベルを受け付ける。
+    void update_level_mask(){
+        std::lock_guard<std::mutex> lock(sinks_mtx);
+        const auto& current = *sinks.load();
+        level_mask accepted = current.empty() ? all_levels : 0;
+        for (const auto& s : current){
+            accepted |= s->accepted_levels;
+        }
+        enabled.store(threshold.load(std::memory_order_relaxed) & accepted, std::memory_order_relaxed);
+    }
+
+    bool is_enabled(level lvl) const {
+        return (enabled.load(std::memory_order_relaxed) & level_bit(lvl)) != 0;
+    }
+
+    // 容量超過等により破棄されたログの累計数
+    uint64_t dropped_count() const {
+        return push_failed.load(std::memory_order_relaxed) + logs->dropped();
+    }
+
+    // 未出力のログのおおよその数
+    uint64_t pending_count() const {
+        const auto out = popped.load(std::memory_order_relaxed) + logs->dropped();
+        const auto in = pushed.load(std::memory_order_relaxed);
+        return in > out ? in - out : 0;
+    }
+
+    // ------------------------------------
+    // 計測
+
+    // 計測値を取得する。どのスレッドから呼んでも良い。
+    logger_telemetry telemetry(){
+        logger_telemetry t;
+        t.enqueued = pushed.load(std::memory_order_relaxed);
+        t.dropped = dropped_count();
+        t.pending = pending_count();
+        t.max_depth = max_depth.load(std::memory_order_relaxed);
+        t.flushes = flushes.load(std::memory_order_relaxed);
+        t.flush_ns_total = flush_ns_total.load(std::memory_order_relaxed);
+        t.flush_ns_max = flush_ns_max.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < t.flush_histogram.size(); ++i){
+            t.flush_histogram[i] = flush_histogram[i].load(std::memory_order_relaxed);
+        }
+        with_sinks([&](const sink_list& current){
+            for (const auto& s : current){
+                t.sinks.push_back(s->stats());
+            }
+        });
+        return t;
+    }
+
+    // intervalごとに、計測値をdebugレベルのログとしてsinkへ出力する。0で停止する。
+    // 出力はflush時に行われるため、実際の間隔はflushの間隔に依存する。
+    void set_telemetry_report_interval(std::chrono::milliseconds interval){
+        report_interval_ms.store(interval.count(), std::memory_order_relaxed);
+    }
+
+    // flusherとの起床通知。flusher以外から使う必要はない。
+    std::shared_ptr<detail::flush_signal> flush_signal() const {
+        return signal;
+    }
+
+private:
+    // コンテナを空になるまで取り出し、sinkに出力する。combinerを取得したスレッドのみが呼ぶ。
+    // 前回以降に破棄されたログがあれば、その数を最初に報告する。
+    void drain(){
+    #ifdef ALGLOG_TSC_CLOCK
+        clock.recalibrate();
+    #endif
+        const auto depth = pending_count();
+        if (depth > max_depth.load(std::memory_order_relaxed)){
+            max_depth.store(depth, std::memory_order_relaxed);
+        }
+        const auto dropped = dropped_count();
+        if (dropped != drop_reported){
+            output_internal(level::alert, fmt::format("[alglog] {} messages dropped", dropped - drop_reported));
+            drop_reported = dropped;
+        }
+        const auto interval = report_interval_ms.load(std::memory_order_relaxed);
+        if (interval > 0 && std::chrono::steady_clock::now() - last_report >= std::chrono::milliseconds(interval)){
+            last_report = std::chrono::steady_clock::now();
+            report_telemetry();
+        }
+        if (batch.size() != flush_batch_size){
+            batch.resize(flush_batch_size); // 以後、msgの確保領域を使い回す
+        }
+        while(true){
+            const auto n = logs->pop_n(batch.data(), batch.size());
+            if (n == 0){
+                break;
+            }
+            popped.fetch_add(n, std::memory_order_relaxed);
+            for (size_t i = 0; i < n; ++i){
+            #ifdef ALGLOG_TSC_CLOCK
+                batch[i].time = clock.to_wall(batch[i].time);
+            #endif
+                batch[i].resolve(pool.get());
+            }
+            with_sinks([&](const sink_list& current){
+                for(auto& s : current){
+                    s->_cond_output_batch(span<const log_t>(batch.data(), n));
+                }
+            });
+            if (n < batch.size()){
+                break;
+            }
+        }
+    }
+
+    // alglog自身のログを、コンテナを経由せずにsinkへ出力する。drainから呼ぶ。
+    void output_internal(level lvl, std::string msg){
+        log_t d;
+        d.msg = std::move(msg);
+        d.lvl = lvl;
+        stamp(d);
+    #ifdef ALGLOG_TSC_CLOCK
+        d.time = clock.to_wall(d.time);
+    #endif
+        with_sinks([&](const sink_list& current){
+            for(auto& s : current){
+                s->_cond_output_batch(span<const log_t>(&d, 1));
+            }
+        });
+    }
+
+    // 現在のsinkの一覧をロックを取らずに参照する。
+    template <class F>
+    void with_sinks(F&& f){
+        sink_readers.fetch_add(1, std::memory_order_seq_cst);
+        struct release_guard{
+            std::atomic<uint32_t>& readers;
+            ~release_guard(){ readers.fetch_sub(1, std::memory_order_release); }
+        } guard{sink_readers};
+        f(*sinks.load(std::memory_order_seq_cst));
+    }
+
+    // sinkの一覧を差し替える。sinks_mtxを保持して呼ぶ。
+    // 読み手は参照を始める前にsink_readersを増やすため、差し替え後にsink_readersが0であれば古い一覧は参照されていない。
+    // waitがtrueであれば、読み手がいなくなるまで待ってから古い一覧を破棄する。
+    // falseであれば、読み手が残っている場合は破棄を次回の差し替えまで先送りする（sinkの出力中からの接続のため）。
+    void publish_sinks(std::unique_ptr<sink_list> next, bool wait){
+        retired_sinks.emplace_back(sinks.exchange(next.release(), std::memory_order_seq_cst));
+        if (wait){
+            while (sink_readers.load(std::memory_order_seq_cst) != 0){
+                std::this_thread::yield();
+            }
+        }
+        if (sink_readers.load(std::memory_order_seq_cst) == 0){
+            retired_sinks.clear();
+        }
+    }
+
+    void report_telemetry(){
+        if (!is_enabled(level::debug)){
+            return;
+        }
+        const auto n = flushes.load(std::memory_order_relaxed);
+        const auto total_ns = flush_ns_total.load(std::memory_order_relaxed);
+        output_internal(level::debug, fmt::format("[alglog] telemetry enqueued={} dropped={} pending={} max_depth={} flushes={} flush_avg_us={:.1f} flush_max_us={:.1f}",
+            pushed.load(std::memory_order_relaxed), dropped_count(), pending_count(), max_depth.load(std::memory_order_relaxed),
+            n, n ? static_cast<double>(total_ns) / static_cast<double>(n) / 1000.0 : 0.0,
+            static_cast<double>(flush_ns_max.load(std::memory_order_relaxed)) / 1000.0));
+    }
+
+    void record_flush_time(std::chrono::steady_clock::duration d){
+        const auto ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+        size_t bucket = 0;
+        for (auto us = ns / 1000; us != 0 && bucket + 1 < flush_histogram.size(); us >>= 1){
+            ++bucket;
+        }
+        flush_histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+        flushes.fetch_add(1, std::memory_order_relaxed);
+        flush_ns_total.fetch_add(ns, std::memory_order_relaxed);
+        if (ns > flush_ns_max.load(std::memory_order_relaxed)){
+            flush_ns_max.store(ns, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    // 保管されているログを全て出力する。
+    //
+    // flat combining : 複数のスレッドが同時にflushを呼んでも、drainを行うのはcombinerフラグを取得した1スレッドのみで、
+    // 他のスレッドが積んだログもまとめて出力する。他のスレッドは、呼び出し以降に開始したdrainが完了するまで待って戻る。
+    // これにより、コンテナは常に単一のconsumerから取り出され、sinkも同時に呼ばれることがない。
+    // 同期モードでは、ログを積んだスレッドはそのログが出力されたことを確認してから戻る。
+    // sinkのoutput中に同じloggerへログを記録しても良い（そのログは実行中のdrainの後に続けて出力される）。
+    void flush(){
+        if (combiner.load(std::memory_order_relaxed) == std::this_thread::get_id()){
+            // sinkのoutput中にこのloggerへログが記録された。drainの完了を待つと自分自身を待つことになるため、
+            // 外側のdrainが終わった後に改めて取り出すよう記録して戻る。
+            reentered = true;
+            return;
+        }
+        // 自分が積んだログのpushと、ticketの読み取りの順序を保証する。
+        // combinerのfetch_add（seq_cst）と対になり、古いticketを読んだ場合は、そのpassのdrainが自分のログを必ず取り出す。
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const auto ticket = pass_started.load(std::memory_order_acquire);
+        while (pass_done.load(std::memory_order_acquire) <= ticket){
+            if (combining.exchange(true, std::memory_order_acquire)){
+                std::this_thread::yield(); // 他のスレッドがdrain中。完了を待つ
+                continue;
+            }
+            struct release_guard{
+                std::atomic<bool>& flag;
+                std::atomic<std::thread::id>& owner;
+                ~release_guard(){
+                    owner.store(std::thread::id(), std::memory_order_relaxed);
+                    flag.store(false, std::memory_order_release);
+                }
+            } guard{combining, combiner};
+            combiner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+            const auto pass = pass_started.fetch_add(1, std::memory_order_seq_cst) + 1;
+            const auto begin = std::chrono::steady_clock::now();
+            do{
+                reentered = false;
+                drain();
+            }while (reentered);
+            record_flush_time(std::chrono::steady_clock::now() - begin);
+            pass_done.store(pass, std::memory_order_release);
+        }
+    }
+
+    // ------------------------------------
+    // ログ保管
+
+    // フォーマット済みのメッセージでログを保管する。
+    void raw_store(source_location loc, const level lvl, const std::string& msg){
+        if (!is_enabled(lvl)){
+            return;
+        }
+        log_t log;
+        log.lvl = lvl;
+        log.loc = loc;
+        push_log(std::move(log), msg);
+    }
+
+    void raw_store(const level lvl, const std::string& msg){
+        raw_store(source_location{}, lvl, msg);
+    }
+
+    void raw_store(callsite& cs, const level lvl, const std::string& msg){
+        if (is_enabled(lvl) && cs.admit(lvl)){
+            raw_store(cs.loc, lvl, msg);
+        }
+    }
+
+    // トレーススパンの開始・終了を記録する。通常はtrace_spanから呼ばれる。
+    void span_store(source_location loc, const level lvl, const span_info& sp, std::string_view msg){
+        log_t log;
+        log.lvl = lvl;
+        log.loc = loc;
+        log.span = sp;
+        push_log(std::move(log), msg);
+    }
+
+    template <class ... T>
+    void fmt_store(callsite& cs, const level lvl, fmt::format_string<T...> fmt, T&&... args){
+        if (is_enabled(lvl) && cs.admit(lvl)){
+            fmt_store(cs.loc, lvl, fmt, std::forward<T>(args)...);
+        }
+    }
+
+    template <class ... T>
+    void fmt_store(source_location loc, const level lvl, fmt::format_string<T...> fmt, T&&... args){
+        // TODO : C++17以降であればconstexpr ifを使える
+        switch(lvl){
+            case level::error:
+                #ifdef ALGLOG_ERROR_ON
+                    store(loc, lvl, fmt, std::forward<T>(args)...);
+                #endif
+                break;
+            case level::alert:
+                #ifdef ALGLOG_ALERT_ON
+                    store(loc, lvl, fmt, std::forward<T>(args)...);
+                #endif
+                break;
+            case level::info:
+                #ifdef ALGLOG_INFO_ON
+                    store(loc, lvl, fmt, std::forward<T>(args)...);
+                #endif
+                break;
+            case level::critical:
+                #ifdef ALGLOG_CRITICAL_ON
+                    store(loc, lvl, fmt, std::forward<T>(args)...);
+                #endif
+                break;
+            case level::warn:
+                #ifdef ALGLOG_WARN_ON
+                    store(loc, lvl, fmt, std::forward<T>(args)...);
+                #endif
+                break;
+            case level::debug:
+                #ifdef ALGLOG_DEBUG_ON
+                    store(loc, lvl, fmt, std::forward<T>(args)...);
+                #endif
+                break;
+            case level::trace:
+                #ifdef ALGLOG_TRACE_ON
+                    store(loc, lvl, fmt, std::forward<T>(args)...);
+                #endif
+                break;
+            default:
+                break;
+        }
+    }
+
+    template <class ... T>
+    void fmt_store(const level lvl, fmt::format_string<T...> fmt, T&&... args){
+        fmt_store(source_location{}, lvl, fmt, std::forward<T>(args)...);
+    }
+
+    // ----------------------------------------------
+
+    template <class ... T>
+    void error(fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_ERROR_ON
+            store(source_location{}, level::error, fmt, std::forward<T>(args)...);
+        #endif
+    }
+
+    template <class ... T>
+    void alert(fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_ALERT_ON
+            store(source_location{}, level::alert, fmt, std::forward<T>(args)...);
+        #endif
+    }
+
+    template <class ... T>
+    void info(fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_INFO_ON
+            store(source_location{}, level::info, fmt, std::forward<T>(args)...);
+        #endif
+    }
+
+    template <class ... T>
+    void critical(source_location loc, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_CRITICAL_ON
+            store(loc, level::critical, fmt, std::forward<T>(args)...);
+        #endif
+    }
+    template <class ... T>
+    void critical(fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_CRITICAL_ON
+            store(source_location{}, level::critical, fmt, std::forward<T>(args)...);
+        #endif
     }
 
 
     template <class ... T>
     void warn(source_location loc, fmt::format_string<T...> fmt, T&&... args){
         #ifdef ALGLOG_WARN_ON
-            raw_store(loc, level::warn, fmt::format(fmt, std::forward<T>(args)...));
+            store(loc, level::warn, fmt, std::forward<T>(args)...);
+        #endif
+    }
+    template <class ... T>
+    void warn(fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_WARN_ON
+            store(source_location{}, level::warn, fmt, std::forward<T>(args)...);
+        #endif
+    }
+
+    template <class ... T>
+    void debug(source_location loc, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_DEBUG_ON
+            store(loc, level::debug, fmt, std::forward<T>(args)...);
+        #endif
+    }
+    template <class ... T>
+    void debug(fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_DEBUG_ON
+            store(source_location{}, level::debug, fmt, std::forward<T>(args)...);
+        #endif
+    }
+
+    template <class ... T>
+    void trace(source_location loc, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_TRACE_ON
+            store(loc, level::trace, fmt, std::forward<T>(args)...);
+        #endif
+    }
+    template <class ... T>
+    void trace(fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_TRACE_ON
+            store(source_location{}, level::trace, fmt, std::forward<T>(args)...);
+        #endif
+    }
+
+    // ----------------------------------------------
+    // 出力箇所の記述子（ALGLOG_SR）を受け取る版。記述子の有効フラグと頻度制限を確認してから記録する。
+
+    template <class ... T>
+    void error(callsite& cs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_ERROR_ON
+            if (is_enabled(level::error) && cs.admit(level::error)){
+                store(cs.loc, level::error, fmt, std::forward<T>(args)...);
+            }
+        #endif
+    }
+    template <class ... T>
+    void alert(callsite& cs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_ALERT_ON
+            if (is_enabled(level::alert) && cs.admit(level::alert)){
+                store(cs.loc, level::alert, fmt, std::forward<T>(args)...);
+            }
+        #endif
+    }
+    template <class ... T>
+    void info(callsite& cs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_INFO_ON
+            if (is_enabled(level::info) && cs.admit(level::info)){
+                store(cs.loc, level::info, fmt, std::forward<T>(args)...);
+            }
+        #endif
+    }
+    template <class ... T>
+    void critical(callsite& cs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_CRITICAL_ON
+            if (is_enabled(level::critical) && cs.admit(level::critical)){
+                store(cs.loc, level::critical, fmt, std::forward<T>(args)...);
+            }
+        #endif
+    }
+    template <class ... T>
+    void warn(callsite& cs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_WARN_ON
+            if (is_enabled(level::warn) && cs.admit(level::warn)){
+                store(cs.loc, level::warn, fmt, std::forward<T>(args)...);
+            }
+        #endif
+    }
+    template <class ... T>
+    void debug(callsite& cs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_DEBUG_ON
+            if (is_enabled(level::debug) && cs.admit(level::debug)){
+                store(cs.loc, level::debug, fmt, std::forward<T>(args)...);
+            }
+        #endif
+    }
+    template <class ... T>
+    void trace(callsite& cs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_TRACE_ON
+            if (is_enabled(level::trace) && cs.admit(level::trace)){
+                store(cs.loc, level::trace, fmt, std::forward<T>(args)...);
+            }
+        #endif
+    }
+
+    // ----------------------------------------------
+    // フィールドを受け取る版。フィールドは整形されずに保持され、json_formatter等で出力される。
+    // 例 : lgr->info(alglog::fields{{"user", id}, {"elapsed_ms", ms}}, "request done");
+
+    template <class ... T>
+    void error(fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_ERROR_ON
+            store(source_location{}, level::error, fs, fmt, std::forward<T>(args)...);
+        #endif
+    }
+    template <class ... T>
+    void error(callsite& cs, fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_ERROR_ON
+            if (is_enabled(level::error) && cs.admit(level::error)){
+                store(cs.loc, level::error, fs, fmt, std::forward<T>(args)...);
+            }
+        #endif
+    }
+    template <class ... T>
+    void alert(fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_ALERT_ON
+            store(source_location{}, level::alert, fs, fmt, std::forward<T>(args)...);
+        #endif
+    }
+    template <class ... T>
+    void alert(callsite& cs, fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_ALERT_ON
+            if (is_enabled(level::alert) && cs.admit(level::alert)){
+                store(cs.loc, level::alert, fs, fmt, std::forward<T>(args)...);
+            }
+        #endif
+    }
+    template <class ... T>
+    void info(fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_INFO_ON
+            store(source_location{}, level::info, fs, fmt, std::forward<T>(args)...);
+        #endif
+    }
+    template <class ... T>
+    void info(callsite& cs, fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_INFO_ON
+            if (is_enabled(level::info) && cs.admit(level::info)){
+                store(cs.loc, level::info, fs, fmt, std::forward<T>(args)...);
+            }
+        #endif
+    }
+    template <class ... T>
+    void critical(source_location loc, fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_CRITICAL_ON
+            store(loc, level::critical, fs, fmt, std::forward<T>(args)...);
+        #endif
+    }
+    template <class ... T>
+    void critical(fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_CRITICAL_ON
+            store(source_location{}, level::critical, fs, fmt, std::forward<T>(args)...);
+        #endif
+    }
+    template <class ... T>
+    void critical(callsite& cs, fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_CRITICAL_ON
+            if (is_enabled(level::critical) && cs.admit(level::critical)){
+                store(cs.loc, level::critical, fs, fmt, std::forward<T>(args)...);
+            }
+        #endif
+    }
+    template <class ... T>
+    void warn(source_location loc, fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_WARN_ON
+            store(loc, level::warn, fs, fmt, std::forward<T>(args)...);
+        #endif
+    }
+    template <class ... T>
+    void warn(fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_WARN_ON
+            store(source_location{}, level::warn, fs, fmt, std::forward<T>(args)...);
+        #endif
+    }
+    template <class ... T>
+    void warn(callsite& cs, fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_WARN_ON
+            if (is_enabled(level::warn) && cs.admit(level::warn)){
+                store(cs.loc, level::warn, fs, fmt, std::forward<T>(args)...);
+            }
+        #endif
+    }
+    template <class ... T>
+    void debug(source_location loc, fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_DEBUG_ON
+            store(loc, level::debug, fs, fmt, std::forward<T>(args)...);
+        #endif
+    }
+    template <class ... T>
+    void debug(fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_DEBUG_ON
+            store(source_location{}, level::debug, fs, fmt, std::forward<T>(args)...);
+        #endif
+    }
+    template <class ... T>
+    void debug(callsite& cs, fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_DEBUG_ON
+            if (is_enabled(level::debug) && cs.admit(level::debug)){
+                store(cs.loc, level::debug, fs, fmt, std::forward<T>(args)...);
+            }
+        #endif
+    }
+    template <class ... T>
+    void trace(source_location loc, fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_TRACE_ON
+            store(loc, level::trace, fs, fmt, std::forward<T>(args)...);
+        #endif
+    }
+    template <class ... T>
+    void trace(fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_TRACE_ON
+            store(source_location{}, level::trace, fs, fmt, std::forward<T>(args)...);
+        #endif
+    }
+    template <class ... T>
+    void trace(callsite& cs, fields fs, fmt::format_string<T...> fmt, T&&... args){
+        #ifdef ALGLOG_TRACE_ON
+            if (is_enabled(level::trace) && cs.admit(level::trace)){
+                store(cs.loc, level::trace, fs, fmt, std::forward<T>(args)...);
+            }
+        #endif
+    }
+};
+
+// ロガーをフラッシュするスレッドを管理するヘルパークラス
+// 通常は眠っており、未出力のログが閾値を超えたとき、errorレベルのログが記録されたとき、
+// または一定時間が経過したときにフラッシュする。
+class flusher{
+private:
+    std::weak_ptr<logger> lgr;
+    std::shared_ptr<detail::flush_signal> signal;
+    std::atomic<bool> flusher_thread_run;
+    std::unique_ptr<std::thread> flusher_thread = nullptr;
+public:
+    flusher(std::weak_ptr<logger> logger_weak_ptr) : lgr(logger_weak_ptr), flusher_thread_run(false) {
+        if (auto l = lgr.lock()){
+            assert(l->async_mode);
+            signal = l->flush_signal();
+        }
+    }
+    ~flusher(){
+        if(flusher_thread){
+            stop();
+            flusher_thread->join(); // 終了まで待機
+        }
+    }
+
+    // loggerを監視し、必要に応じてフラッシュする。
+    // interval_ms : 起こされなかった場合でも、この間隔でフラッシュする（上限）。
+    // high_watermark : 未出力のログがこの数に達したらすぐにフラッシュする。
+    void start(int interval_ms = 500, size_t high_watermark = ALGLOG_FLUSHER_HIGH_WATERMARK){
+        if (!signal){
+            return;
+        }
+        auto interval = std::chrono::milliseconds(interval_ms);
+        signal->high_watermark.store(high_watermark, std::memory_order_relaxed);
+        signal->active.store(true, std::memory_order_relaxed);
+        flusher_thread_run = true;
+        flusher_thread = std::make_unique<std::thread>([&,interval]{
+            #ifdef ALGLOG_INTERNAL_ON
+                if (auto l = lgr.lock()){
+                    l->raw_store(level::debug, "[alglog] start event-driven flushing");
+                }
+            #endif
+            set_thread_priority_lowest();
+
+            while(flusher_thread_run){
+                signal->wait_for(interval); // loggerの寿命を延ばさないよう、待機中はloggerを保持しない
+                if (!flusher_thread_run){
+                    break;
+                }
+                if (auto l = lgr.lock()){
+                    l->flush();
+                }else{
+                    break; // loggerが解放された場合、flusherのスレッドも終了する
+                }
+            }
+        });
+    }
+    void stop(){
+        flusher_thread_run = false;
+        if (signal){
+            signal->active.store(false, std::memory_order_relaxed);
+            signal->notify();
+        }
+    }
+};
+
+// ------------------------------------
+
+
+namespace detail{
+
+    // ファイルディスクリプタの薄いラッパ。
+    // ストリームを介さずに書き込むことで、システムコールの発行タイミングを制御する。
+    class file_handle{
+    private:
+        int fd = -1;
+    public:
+        file_handle() = default;
+        file_handle(const file_handle&) = delete;
+        file_handle& operator=(const file_handle&) = delete;
+        file_handle(file_handle&& o) noexcept : fd(o.fd) {
+            o.fd = -1;
+        }
+        file_handle& operator=(file_handle&& o) noexcept {
+            if (this != &o){
+                close();
+                fd = o.fd;
+                o.fd = -1;
+            }
+            return *this;
+        }
+        ~file_handle(){
+            close();
+        }
+
+        void swap(file_handle& o) noexcept {
+            std::swap(fd, o.fd);
+        }
+
+        bool open(const std::string& path, bool append = false){
+            close();
+        #if defined(_WIN32) || defined(_WIN64)
+            const int flags = _O_WRONLY | _O_CREAT | _O_BINARY | (append ? _O_APPEND : _O_TRUNC);
+            if (_sopen_s(&fd, path.c_str(), flags, _SH_DENYNO, _S_IREAD | _S_IWRITE) != 0){
+                fd = -1;
+            }
+        #else
+            const int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+            fd = ::open(path.c_str(), flags, 0644);
         #endif
-    }
-    template <class ... T>
-    void warn(fmt::format_string<T...> fmt, T&&... args){
-        #ifdef ALGLOG_WARN_ON
-            raw_store(level::warn, fmt::format(fmt, std::forward<T>(args)...));
+            return fd >= 0;
+        }
+
+        // ファイルを新規に作成して開く。既に存在する場合は失敗する。
+        bool create(const std::string& path){
+            close();
+        #if defined(_WIN32) || defined(_WIN64)
+            const int flags = _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY;
+            if (_sopen_s(&fd, path.c_str(), flags, _SH_DENYNO, _S_IREAD | _S_IWRITE) != 0){
+                fd = -1;
+            }
+        #else
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        #endif
+            return fd >= 0;
+        }
+
+        bool is_open() const {
+            return fd >= 0;
+        }
+
+        int native() const {
+            return fd;
+        }
+
+        // 全て書き込むまでwriteを繰り返す。発行したシステムコール数をsyscallsに加算する。
+        bool write_all(const char* p, size_t n, uint64_t& syscalls){
+            while (n > 0){
+            #if defined(_WIN32) || defined(_WIN64)
+                const auto chunk = static_cast<unsigned int>(std::min<size_t>(n, 1u << 30));
+                const auto ret = _write(fd, p, chunk);
+            #else
+                const auto ret = ::write(fd, p, n);
+            #endif
+                ++syscalls;
+                if (ret < 0){
+                #if !(defined(_WIN32) || defined(_WIN64))
+                    if (errno == EINTR){
+                        continue;
+                    }
+                #endif
+                    return false;
+                }
+                p += ret;
+                n -= static_cast<size_t>(ret);
+            }
+            return true;
+        }
+
+        // 書き込んだデータをストレージへ永続化する（メタデータの同期は最小限）。
+        bool sync(){
+        #if defined(_WIN32) || defined(_WIN64)
+            return _commit(fd) == 0;
+        #elif defined(__linux__)
+            return ::fdatasync(fd) == 0;
+        #else
+            return ::fsync(fd) == 0;
         #endif
+        }
+
+        // ファイルサイズを変えずに領域を事前確保する。追記時のブロック割り当てを避けるため。
+        // 対応していないプラットフォームでは何もしない。
+        bool preallocate(uint64_t bytes){
+        #if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+            return ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(bytes)) == 0;
+        #else
+            (void)bytes;
+            return false;
+        #endif
+        }
+
+        // 指定サイズに切り詰める。事前確保した未使用領域の解放に使う。
+        bool truncate(uint64_t bytes){
+        #if defined(_WIN32) || defined(_WIN64)
+            return _chsize_s(fd, static_cast<__int64>(bytes)) == 0;
+        #else
+            return ::ftruncate(fd, static_cast<off_t>(bytes)) == 0;
+        #endif
+        }
+
+        void close(){
+            if (fd >= 0){
+            #if defined(_WIN32) || defined(_WIN64)
+                _close(fd);
+            #else
+                ::close(fd);
+            #endif
+                fd = -1;
+            }
+        }
+    };
+
+    // セグメントファイルのパス "<stem>.<index><ext>" を返す。
+    inline std::string segment_path(const std::string& base_name, uint64_t index){
+        const auto slash = base_name.find_last_of("/\\");
+        const auto dot = base_name.find_last_of('.');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash)){
+            return fmt::format("{}.{}", base_name, index);
+        }
+        return fmt::format("{}.{}{}", base_name.substr(0, dot), index, base_name.substr(dot));
+    }
+
+    // segment_pathの名前で既に存在するセグメントの番号を、昇順で返す。
+    inline std::vector<uint64_t> existing_segments(const std::string& base_name){
+        namespace fs = std::filesystem;
+        const fs::path base(base_name);
+        const std::string prefix = base.stem().string() + ".";
+        const std::string ext = base.extension().string();
+        const fs::path dir = base.has_parent_path() ? base.parent_path() : fs::path(".");
+        std::vector<uint64_t> found;
+        std::error_code ec;
+        for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)){
+            const std::string name = it->path().filename().string();
+            if (name.size() <= prefix.size() + ext.size() || name.compare(0, prefix.size(), prefix) != 0
+                || name.compare(name.size() - ext.size(), ext.size(), ext) != 0 || !it->is_regular_file(ec)){
+                continue;
+            }
+            const auto digits = name.substr(prefix.size(), name.size() - prefix.size() - ext.size());
+            if (digits.size() > 18 || digits.find_first_not_of("0123456789") != std::string::npos){
+                continue;
+            }
+            found.push_back(std::stoull(digits));
+        }
+        std::sort(found.begin(), found.end());
+        return found;
+    }
+
+} // namespace detail
+
+// ------------------------------------
+// バイナリログ形式
+//
+// ファイル先頭に magic(8byte) を置き、以降はタグ(1byte)で始まるレコードが続く。整数は全てLEB128の可変長整数。
+//   tag_callsite : id, line, file(文字列), func(文字列)   … 初出のソース位置ごとに1度だけ書かれる
+//   tag_thread   : id, pid, tid, name(文字列)            … 初出のスレッドごとに1度だけ書かれる
+//   tag_log      : 時刻差分(ns, zigzag), level, thread id, callsite id, msg(文字列)
+//   tag_fields   : fields(文字列)                        … フィールドを持つログの直後にのみ書かれる。内容はlog_fieldsのエンコードのまま
+// 文字列は 長さ(可変長整数) + バイト列 で表す。
+
+namespace binary{
+
+    static constexpr char magic[8] = {'A','L','G','L','O','G','B','1'};
+    static constexpr uint8_t tag_callsite = 1;
+    static constexpr uint8_t tag_thread = 2;
+    static constexpr uint8_t tag_log = 3;
+    static constexpr uint8_t tag_fields = 4;
+
+    inline void put_varint(fmt::memory_buffer& buf, uint64_t v){
+        while (v >= 0x80){
+            buf.push_back(static_cast<char>((v & 0x7F) | 0x80));
+            v >>= 7;
+        }
+        buf.push_back(static_cast<char>(v));
+    }
+
+    inline void put_string(fmt::memory_buffer& buf, std::string_view s){
+        put_varint(buf, s.size());
+        buf.append(s.data(), s.data() + s.size());
+    }
+
+    inline uint64_t zigzag(int64_t v){
+        return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+    }
+
+    inline int64_t unzigzag(uint64_t v){
+        return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+    }
+
+    // ログをバイナリ形式にエンコードする。ソース位置とスレッドは辞書化し、初出時のみ定義を書き出す。
+    class encoder{
+    private:
+        struct callsite_key{
+            const char* file;
+            int line;
+            const char* func;
+            bool operator==(const callsite_key& o) const {
+                return file == o.file && line == o.line && func == o.func;
+            }
+        };
+        struct callsite_hash{
+            size_t operator()(const callsite_key& k) const {
+                const auto h = std::hash<const void*>{};
+                return h(k.file) ^ (h(k.func) << 1) ^ (static_cast<size_t>(k.line) << 7);
+            }
+        };
+        std::unordered_map<callsite_key, uint64_t, callsite_hash> callsites;
+        std::unordered_map<uint32_t, uint64_t> threads; // スレッドレジストリのインデックス → ファイル内のid
+        int64_t last_ns = 0;
+
+    public:
+        void header(fmt::memory_buffer& buf){
+            buf.append(magic, magic + sizeof(magic));
+        }
+
+        void encode(fmt::memory_buffer& buf, const log_t& l){
+            const callsite_key ck{l.loc.file, l.loc.line, l.loc.func};
+            auto cit = callsites.find(ck);
+            if (cit == callsites.end()){
+                cit = callsites.emplace(ck, callsites.size()).first;
+                buf.push_back(static_cast<char>(tag_callsite));
+                put_varint(buf, cit->second);
+                put_varint(buf, static_cast<uint64_t>(l.loc.line));
+                put_string(buf, l.loc.file);
+                put_string(buf, l.loc.func);
+            }
+            auto tit = threads.find(l.thread);
+            if (tit == threads.end()){
+                tit = threads.emplace(l.thread, threads.size()).first;
+                const auto ti = l.get_thread();
+                buf.push_back(static_cast<char>(tag_thread));
+                put_varint(buf, tit->second);
+                put_varint(buf, l.pid);
+                put_varint(buf, ti.os_tid);
+                put_string(buf, ti.name);
+            }
+            const int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(l.time.time_since_epoch()).count();
+            buf.push_back(static_cast<char>(tag_log));
+            put_varint(buf, zigzag(ns - last_ns));
+            put_varint(buf, static_cast<uint64_t>(l.lvl));
+            put_varint(buf, tit->second);
+            put_varint(buf, cit->second);
+            put_string(buf, l.msg);
+            if (!l.fields.empty()){
+                buf.push_back(static_cast<char>(tag_fields));
+                put_string(buf, l.fields.blob());
+            }
+            last_ns = ns;
+        }
+    };
+
+    // バイナリ形式のログを読み出す。
+    // 読み出したlog_tのlocはreaderが保持する辞書を参照するため、readerより長く保持しないこと。
+    // ファイル内のスレッドはスレッドレジストリに登録され、log_t::threadから通常のフォーマッタで参照できる。
+    class reader{
+    private:
+        struct callsite{
+            std::string file;
+            std::string func;
+            int line = 0;
+        };
+        struct thread{
+            uint32_t pid = 0;
+            uint64_t tid = 0;
+            uint32_t index = 0; // スレッドレジストリのインデックス
+        };
+
+        std::istream& is;
+        std::string text; // メッセージ読み込み用の作業領域
+        std::vector<std::unique_ptr<callsite>> callsites; // c_strの位置を固定するためunique_ptrで保持する
+        std::vector<thread> threads;
+        int64_t last_ns = 0;
+        bool valid = false;
+
+        bool get_varint(uint64_t& v){
+            v = 0;
+            for (int shift = 0; shift < 64; shift += 7){
+                const int c = is.get();
+                if (c == std::char_traits<char>::eof()){
+                    return false;
+                }
+                v |= static_cast<uint64_t>(c & 0x7F) << shift;
+                if (!(c & 0x80)){
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool get_string(log_message& s){
+            if (!get_string(text)){
+                return false;
+            }
+            s = text;
+            return true;
+        }
+
+        bool get_string(std::string& s){
+            uint64_t n;
+            if (!get_varint(n)){
+                return false;
+            }
+            s.resize(static_cast<size_t>(n));
+            return n == 0 || static_cast<bool>(is.read(&s[0], static_cast<std::streamsize>(n)));
+        }
+
+    public:
+        explicit reader(std::istream& is) : is(is) {
+            char m[sizeof(magic)];
+            if (is.read(m, sizeof(m))){
+                valid = std::memcmp(m, magic, sizeof(magic)) == 0;
+            }
+        }
+
+        // magicが正しく読めたかどうか
+        bool is_valid() const {
+            return valid;
+        }
+
+        // 次のログを読み出す。tidにはスレッドの数値IDが入る。終端または不正なデータでfalseを返す。
+        bool next(log_t& l, uint64_t& tid){
+            if (!next(l)){
+                return false;
+            }
+            tid = get_thread_info(l.thread).os_tid;
+            return true;
+        }
+
+        // 次のログを読み出す。終端または不正なデータでfalseを返す。
+        bool next(log_t& l){
+            while (valid){
+                const int tag = is.get();
+                if (tag == std::char_traits<char>::eof()){
+                    return false;
+                }
+                uint64_t id, a, b;
+                if (tag == tag_callsite){
+                    auto cs = std::make_unique<callsite>();
+                    if (!get_varint(id) || !get_varint(a) || !get_string(cs->file) || !get_string(cs->func) || id != callsites.size()){
+                        break;
+                    }
+                    cs->line = static_cast<int>(a);
+                    callsites.push_back(std::move(cs));
+                }else if (tag == tag_thread){
+                    thread_info info;
+                    if (!get_varint(id) || !get_varint(a) || !get_varint(b) || id != threads.size() || !get_string(info.name)){
+                        break;
+                    }
+                    info.pid = static_cast<uint32_t>(a);
+                    info.os_tid = b;
+                    threads.push_back(thread{info.pid, b, register_external_thread(std::move(info))});
+                }else if (tag == tag_log){
+                    uint64_t delta, lvl, th, cs;
+                    if (!get_varint(delta) || !get_varint(lvl) || !get_varint(th) || !get_varint(cs) || !get_string(l.msg)
+                        || th >= threads.size() || cs >= callsites.size()){
+                        break;
+                    }
+                    last_ns += unzigzag(delta);
+                    l.time = std::chrono::system_clock::time_point(
+                        std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(last_ns)));
+                    l.lvl = static_cast<level>(lvl);
+                    l.pid = threads[th].pid;
+                    l.thread = threads[th].index;
+                    const auto& c = *callsites[cs];
+                    l.loc = source_location{c.file.c_str(), c.line, c.func.c_str()};
+                    l.args.reset();
+                    l.span = span_info{};
+                    l.fields.clear();
+                    if (is.peek() == tag_fields){
+                        is.get();
+                        if (!get_string(text)){
+                            break;
+                        }
+                        l.fields.assign(std::string_view(text));
+                    }
+                    return true;
+                }else{
+                    break;
+                }
+            }
+            valid = false;
+            return false;
+        }
+    };
+
+} // namespace binary
+
+namespace builtin{
+
+    namespace formatter{
+        // リリース時コンソール出力向けのフォーマッタ
+        const auto simple = [](const log_t& l) -> std::string {
+            return fmt::format("[{:%F %T}] [{}] | {}",
+                l.time, l.get_level_str(), l.msg );
+        };
+        // デバッグ時ファイル出力向けのフォーマッタ。全てのパラメータを出力する
+        const auto full = [](const log_t& l) -> std::string {
+            return fmt::format("[{:%F %T}] [{}] [process {:>8}] [thread {:>8}] [{:>24}:{:<4}({:>24})] | {}",
+                l.time, l.get_level_str(), l.pid, get_thread_label(l.thread), l.loc.file, l.loc.line, l.loc.func, l.msg );
+            // ref : https://cpprefjp.github.io/reference/chrono/format.html
+        };
+        // デバッグ時コンソール出力向けのフォーマッタ
+        const auto console = [](const log_t& l) -> std::string {
+            return fmt::format("[{:%T}] [{}] [{:>24}: {:<4}({:>24})] | {}",
+                l.time, l.get_level_str(), l.loc.file, l.loc.line, l.loc.func, l.msg );
+        };
+
+        // 上記フォーマッタと同じ書式のpattern_formatter用パターン。sink::buffer_formatterに設定して使う。
+        namespace pattern{
+            static constexpr const char* simple = "[%Y-%m-%d %H:%M:%S] [%l] | %v";
+            static constexpr const char* full = "[%Y-%m-%d %H:%M:%S] [%l] [process %8P] [thread %8t] [%24s:%-4#(%24!)] | %v";
+            static constexpr const char* console = "[%H:%M:%S] [%l] [%24s: %-4#(%24!)] | %v";
+        }
+
+    }
+
+// valve
+    namespace valve{
+        const auto always_open = [](const log_t&){return true;};
+        const auto except_trace = [](const log_t& l){if (l.lvl != level::trace) {return true;} else {return false;}};
+        const auto release_only = [](const log_t& l){if (static_cast<int>(l.lvl) <= static_cast<int>(level::info)) {return true;} else {return false;}}; // リリースモードのシミュレートをするだけでバイナリからは消えない。
+        const auto debug_only = [](const log_t& l){if (static_cast<int>(level::critical) <= static_cast<int>(l.lvl)) {return true;} else {return false;}}; // デバッグモードのシミュレートをするだけでバイナリからは消えない。
     }
 
-    template <class ... T>
-    void debug(source_location loc, fmt::format_string<T...> fmt, T&&... args){
-        #ifdef ALGLOG_DEBUG_ON
-            raw_store(loc, level::debug, fmt::format(fmt, std::forward<T>(args)...));
-        #endif
-    }
-    template <class ... T>
-    void debug(fmt::format_string<T...> fmt, T&&... args){
-        #ifdef ALGLOG_DEBUG_ON
-            raw_store(level::debug, fmt::format(fmt, std::forward<T>(args)...));
-        #endif
-    }
+// levels : valveと同じ条件をsink::accepted_levelsとして指定するためのマスク。
+// valveと異なり、loggerが記録時点で判断できるため、破棄されるログのフォーマットを省略できる。
+    namespace levels{
+        constexpr level_mask all = all_levels;
+        constexpr level_mask except_trace = all_levels & ~level_bit(level::trace);
+        constexpr level_mask release_only = levels_up_to(level::info);
+        constexpr level_mask debug_only = all_levels & ~levels_up_to(level::info);
+    }
+
+// sink
+
+    // file_sinkの永続化ポリシー
+    enum class durability{
+        none, // バッファが満杯になったとき、または破棄時にのみ書き込む
+        flush_per_batch, // output_batchごとにOSへ書き込む（デフォルト）
+        sync_interval, // flush_per_batchに加え、sync_interval_msごとにfdatasyncする
+        sync_on_error // flush_per_batchに加え、error / criticalのログを含むバッチの後でfdatasyncする
+    };
+
+    // ユーザー空間のバッファに整形し、まとめてwriteするファイルsink。
+    struct file_sink : public sink{
+    protected:
+        detail::file_handle fh;
+        fmt::memory_buffer buf;
+        const durability policy;
+        const std::chrono::milliseconds sync_interval;
+        const size_t buffer_size;
+        std::chrono::steady_clock::time_point last_sync = std::chrono::steady_clock::now();
+        bool pending_error_sync = false;
+        std::atomic<uint64_t> issued_syscalls{0};
+
+        // ログ1件をバッファへ整形する。
+        virtual void append(const log_t& l){
+            format_to(l, buf);
+            buf.push_back('\n');
+            if (l.lvl == level::error || l.lvl == level::critical){
+                pending_error_sync = true;
+            }
+        }
+
+        // バッファの内容をファイルへ書き込む。
+        virtual void write_out(){
+            if (buf.size() == 0){
+                return;
+            }
+            if (!fh.is_open()){
+                count_error(); // 書き込み先がないため、バッファの内容は失われる
+                buf.clear();
+                return;
+            }
+            uint64_t syscalls = 0;
+            if (fh.write_all(buf.data(), buf.size(), syscalls)){
+                count_bytes(buf.size());
+            }else{
+                count_error();
+            }
+            issued_syscalls.fetch_add(syscalls, std::memory_order_relaxed);
+            buf.clear();
+        }
+
+        void sync(){
+            if (fh.is_open()){
+                fh.sync();
+                issued_syscalls.fetch_add(1, std::memory_order_relaxed);
+            }
+            last_sync = std::chrono::steady_clock::now();
+        }
+
+        // ポリシーに従って書き込み・同期を行う。
+        void commit(){
+            if (policy == durability::none){
+                if (buf.size() >= buffer_size){
+                    write_out();
+                }
+                return;
+            }
+            write_out();
+            if (policy == durability::sync_interval && std::chrono::steady_clock::now() - last_sync >= sync_interval){
+                sync();
+            }
+            if (policy == durability::sync_on_error && pending_error_sync){
+                sync();
+            }
+            pending_error_sync = false;
+        }
+
+        // ファイルを開かずに初期化する。派生クラスが自分でfhを開く場合に使う。
+        file_sink(durability policy, int sync_interval_ms, size_t buffer_size)
+            : policy(policy), sync_interval(sync_interval_ms), buffer_size(buffer_size)
+        {
+            this->valve = valve::always_open;
+            this->formatter = formatter::full;
+            buf.reserve(buffer_size);
+        }
+
+    public:
+        file_sink(const std::string& file_name, durability policy = durability::flush_per_batch, int sync_interval_ms = 1000, size_t buffer_size = 64 * 1024)
+            : file_sink(policy, sync_interval_ms, buffer_size)
+        {
+            if (!fh.open(file_name)){
+                count_error();
+            }
+        }
+        void output(const log_t& l) override {
+            append(l);
+            commit();
+        }
+        void output_batch(span<const log_t> ls) override {
+            for (const auto& l : ls){
+                append(l);
+                if (buf.size() >= buffer_size){
+                    write_out();
+                }
+            }
+            commit();
+        }
+
+        bool is_open() const {
+            return fh.is_open();
+        }
+        // ファイルへ書き込んだバイト数
+        uint64_t bytes_written() const {
+            return stats().bytes;
+        }
+        // 発行したwrite / fdatasyncの回数
+        uint64_t syscalls() const {
+            return issued_syscalls.load(std::memory_order_relaxed);
+        }
+
+        virtual ~file_sink() {
+            write_out();
+            if (policy != durability::none && policy != durability::flush_per_batch){
+                sync();
+            }
+        }
+    };
+
+    // サイズ・時刻でファイルを切り替えるfile_sink。
+    // セグメントは "<stem>.<index><ext>" の名前で作られ、リネームは行わない。
+    // 次のセグメントはバックグラウンドスレッドで事前に作成・領域確保（fallocate）しておき、
+    // 切り替え時はハンドルの差し替えのみを行う。旧セグメントのクローズと、保持数を超えたセグメントの削除もバックグラウンドで行う。
+    // サイズによる切り替えは書き込み単位で判定するため、セグメントは最大でbuffer_size程度max_sizeを超えうる。
+    // 既存のセグメントは上書きしない。再起動時は残っているセグメントの次の番号から書き始め、保持数を超えた分は削除する。
+    // 次のセグメントを用意できなかった場合は、現在のセグメントへの書き込みを続け、次の書き込みで切り替えを再試行する。
+    struct rotating_file_sink : public file_sink{
+    private:
+        const std::string base_name;
+        const uint64_t max_size; // 0の場合はサイズで切り替えない
+        const std::chrono::seconds interval; // 0の場合は時刻で切り替えない
+        const size_t retention; // 保持するセグメント数。0の場合は削除しない
+        static constexpr std::chrono::milliseconds prepare_wait{10}; // 事前準備が間に合わなかった場合に待つ上限
+        uint64_t index = 0;
+        uint64_t current_size = 0;
+        std::chrono::system_clock::time_point next_rotation;
+
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::condition_variable ready_cv;
+        std::deque<std::function<void()>> jobs;
+        detail::file_handle next; // 事前に用意した次のセグメント（mtxで保護）
+        uint64_t next_index = 0; // nextのセグメント番号。0の場合は未準備
+        bool stop = false;
+        std::thread worker;
+
+        std::chrono::system_clock::time_point next_boundary(std::chrono::system_clock::time_point now) const {
+            const auto since = now.time_since_epoch();
+            return std::chrono::system_clock::time_point(since - since % interval + interval);
+        }
+
+        void schedule(std::function<void()> job){
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                jobs.push_back(std::move(job));
+            }
+            cv.notify_one();
+        }
+
+        // 番号iのセグメントを新規に作成する。
+        bool create_segment(detail::file_handle& h, uint64_t i){
+            if (!h.create(detail::segment_path(base_name, i))){
+                return false;
+            }
+            if (max_size > 0){
+                h.preallocate(max_size);
+            }
+            return true;
+        }
+
+        void schedule_prepare(uint64_t i){
+            schedule([this, i]{
+                detail::file_handle h;
+                create_segment(h, i); // 失敗した場合は閉じたハンドルを渡し、rotate側で再試行させる
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    next = std::move(h);
+                    next_index = i;
+                }
+                ready_cv.notify_one();
+            });
+        }
+
+        void worker_loop(){
+            std::unique_lock<std::mutex> lock(mtx);
+            while (true){
+                cv.wait(lock, [this]{ return stop || !jobs.empty(); });
+                if (jobs.empty()){
+                    break; // stop
+                }
+                auto job = std::move(jobs.front());
+                jobs.pop_front();
+                lock.unlock();
+                job();
+                lock.lock();
+            }
+        }
+
+        // 次のセグメントへ切り替える。切り替えられなかった場合はfalseを返し、現在のセグメントへの書き込みを続ける。
+        bool rotate(){
+            detail::file_handle h;
+            {
+                // 通常は準備済み。事前準備が間に合わなかった場合も、flushを止めないよう待つのはprepare_waitまでとする。
+                std::unique_lock<std::mutex> lock(mtx);
+                if (!ready_cv.wait_for(lock, prepare_wait, [this]{ return next_index == index + 1; })){
+                    return false;
+                }
+                h.swap(next);
+                next_index = 0;
+            }
+            if (!h.is_open()){
+                count_error();
+                schedule_prepare(index + 1); // 作成を再試行する
+                return false;
+            }
+            auto old = std::make_shared<detail::file_handle>();
+            old->swap(fh);
+            fh.swap(h);
+            const auto old_size = current_size;
+            ++index;
+            current_size = 0;
+            schedule([old, old_size]{
+                old->truncate(old_size); // 事前確保の未使用分を解放する
+                old->close();
+            });
+            if (retention > 0 && index >= retention){
+                const auto expired = detail::segment_path(base_name, index - retention);
+                schedule([expired]{
+                    std::remove(expired.c_str());
+                });
+            }
+            schedule_prepare(index + 1);
+            return true;
+        }
+
+    protected:
+        void write_out() override {
+            if (buf.size() == 0){
+                return;
+            }
+            bool need_rotate = max_size > 0 && current_size > 0 && current_size + buf.size() > max_size;
+            const auto now = std::chrono::system_clock::now();
+            const bool time_due = interval.count() > 0 && now >= next_rotation;
+            if (time_due){
+                need_rotate = need_rotate || current_size > 0;
+            }
+            const bool rotated = need_rotate && rotate();
+            if (time_due && (rotated || !need_rotate)){
+                next_rotation = next_boundary(now);
+            }
+            current_size += buf.size();
+            file_sink::write_out();
+        }
+
+    public:
+        rotating_file_sink(const std::string& base_name, uint64_t max_size, std::chrono::seconds interval = std::chrono::seconds(0), size_t retention = 0,
+            durability policy = durability::flush_per_batch, size_t buffer_size = 64 * 1024)
+            : file_sink(policy, 1000, buffer_size),
+              base_name(base_name), max_size(max_size), interval(interval), retention(retention)
+        {
+            if (interval.count() > 0){
+                next_rotation = next_boundary(std::chrono::system_clock::now());
+            }
+            // 以前の実行が残したセグメントの次の番号から書き始める
+            const auto existing = detail::existing_segments(base_name);
+            index = existing.empty() ? 0 : existing.back() + 1;
+            if (!create_segment(fh, index)){
+                count_error();
+            }
+            worker = std::thread([this]{ worker_loop(); });
+            for (const auto i : existing){
+                if (retention > 0 && i + retention <= index){
+                    const auto expired = detail::segment_path(base_name, i);
+                    schedule([expired]{
+                        std::remove(expired.c_str());
+                    });
+                }
+            }
+            schedule_prepare(index + 1);
+        }
+
+        // 現在書き込み中のセグメントのパス
+        std::string current_path() const {
+            return detail::segment_path(base_name, index);
+        }
+
+        ~rotating_file_sink(){
+            write_out();
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stop = true;
+            }
+            cv.notify_one();
+            worker.join();
+            fh.truncate(current_size);
+            // 使われなかった次のセグメントを片付ける
+            if (next.is_open()){
+                next.close();
+                std::remove(detail::segment_path(base_name, next_index).c_str());
+            }
+        }
+    };
+
+    // ログをバイナリ形式（alglog::binary）で書き出すfile_sink。
+    // 時刻・スレッド・ソース位置を辞書化・差分化するため、テキスト形式に比べて書き込み量と整形コストが小さい。
+    // alglog-decode でテキスト形式に戻すことができる。
+    struct binary_file_sink : public file_sink{
+    private:
+        binary::encoder enc;
+    protected:
+        void append(const log_t& l) override {
+            enc.encode(buf, l);
+            if (l.lvl == level::error || l.lvl == level::critical){
+                pending_error_sync = true;
+            }
+        }
+    public:
+        binary_file_sink(const std::string& file_name, durability policy = durability::flush_per_batch, int sync_interval_ms = 1000, size_t buffer_size = 64 * 1024)
+            : file_sink(file_name, policy, sync_interval_ms, buffer_size)
+        {
+            enc.header(buf);
+        }
+        ~binary_file_sink(){
+            write_out();
+        }
+    };
+
+    // 1行に1つのJSONオブジェクトを書き出すfile_sink（JSON Lines）。書式はjson_formatterを参照。
+    // 他のsinkでJSONを出力する場合は、buffer_formatterにjson_formatterを設定すれば良い。
+    struct json_file_sink : public file_sink{
+        json_file_sink(const std::string& file_name, durability policy = durability::flush_per_batch, int sync_interval_ms = 1000, size_t buffer_size = 64 * 1024)
+            : file_sink(file_name, policy, sync_interval_ms, buffer_size)
+        {
+            this->buffer_formatter = json_formatter();
+        }
+    };
+
+    // trace_spanが記録したスパンを、Chromeのtrace event形式（JSON配列）で書き出すfile_sink。
+    // 出力はchrome://tracingやPerfetto UI（ui.perfetto.dev）でそのまま開ける。
+    // スパンはB/Eイベント、include_logsがtrueであれば通常のログは瞬間イベント（ph:"i"）として書き出される。
+    // スレッドに名前が付いていれば、thread_nameのメタデータイベントとして書き出す。
+    struct chrome_trace_sink : public file_sink{
+    private:
+        bool first = true;
+        uint64_t threads_version = ~uint64_t(0);
+        std::vector<std::string> thread_keys; // スレッドごとの "\"pid\":...,\"tid\":..." のキャッシュ
+
+        const std::string& thread_key(uint32_t index){
+            const auto ver = detail::thread_registry::instance().version();
+            if (ver != threads_version){
+                thread_keys.clear(); // 登録や名前の変更があった
+                threads_version = ver;
+            }
+            if (index >= thread_keys.size()){
+                thread_keys.resize(index + 1);
+            }
+            auto& key = thread_keys[index];
+            if (key.empty()){
+                const auto info = get_thread_info(index);
+                key = fmt::format("\"pid\":{},\"tid\":{}", info.pid, info.os_tid);
+                if (!info.name.empty()){
+                    begin_event();
+                    buf.append(std::string_view("{\"name\":\"thread_name\",\"ph\":\"M\","));
+                    buf.append(key);
+                    buf.append(std::string_view(",\"args\":{\"name\":"));
+                    detail::append_json_string(buf, info.name);
+                    buf.append(std::string_view("}}"));
+                }
+            }
+            return key;
+        }
+
+        void begin_event(){
+            buf.append(first ? std::string_view("\n") : std::string_view(",\n"));
+            first = false;
+        }
+
+    protected:
+        void append(const log_t& l) override {
+            const auto& key = thread_key(l.thread);
+            const std::string_view msg = l.msg;
+            if (!l.span.is_span() && !include_logs){
+                return;
+            }
+            begin_event();
+            buf.append(std::string_view("{\"name\":"));
+            if (l.span.is_span()){
+                detail::append_json_string(buf, msg.substr(0, l.span.name_len));
+                fmt::format_to(std::back_inserter(buf), ",\"cat\":\"span\",\"ph\":\"{}\"", l.span.phase);
+            }else{
+                detail::append_json_string(buf, msg);
+                fmt::format_to(std::back_inserter(buf), ",\"cat\":\"log\",\"ph\":\"i\",\"s\":\"t\"");
+            }
+            const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(l.time.time_since_epoch()).count();
+            fmt::format_to(std::back_inserter(buf), ",\"ts\":{}.{:03},", ns / 1000, ns % 1000);
+            buf.append(key);
+            if (l.span.is_span()){
+                if (msg.size() > l.span.name_len + 1u){
+                    buf.append(std::string_view(",\"args\":"));
+                    buf.append(msg.substr(l.span.name_len + 1));
+                }
+            }else{
+                buf.append(std::string_view(",\"args\":{\"level\":"));
+                detail::append_json_string(buf, l.level_str());
+                if (l.loc.line != 0){
+                    buf.append(std::string_view(",\"file\":"));
+                    detail::append_json_string(buf, l.loc.file);
+                    fmt::format_to(std::back_inserter(buf), ",\"line\":{}", l.loc.line);
+                }
+                l.fields.for_each([&](const field& f){
+                    buf.push_back(',');
+                    f.append_to(buf);
+                });
+                buf.push_back('}');
+            }
+            buf.push_back('}');
+            if (l.lvl == level::error || l.lvl == level::critical){
+                pending_error_sync = true;
+            }
+        }
+
+    public:
+        bool include_logs = true; // 通常のログも瞬間イベントとして書き出す
 
-    template <class ... T>
-    void trace(source_location loc, fmt::format_string<T...> fmt, T&&... args){
-        #ifdef ALGLOG_TRACE_ON
-            raw_store(loc, level::trace, fmt::format(fmt, std::forward<T>(args)...));
-        #endif
-    }
-    template <class ... T>
-    void trace(fmt::format_string<T...> fmt, T&&... args){
-        #ifdef ALGLOG_TRACE_ON
-            raw_store(level::trace, fmt::format(fmt, std::forward<T>(args)...));
-        #endif
-    }
-};
+        chrome_trace_sink(const std::string& file_name, durability policy = durability::flush_per_batch, int sync_interval_ms = 1000, size_t buffer_size = 64 * 1024)
+            : file_sink(file_name, policy, sync_interval_ms, buffer_size)
+        {
+            buf.push_back('[');
+        }
+        ~chrome_trace_sink(){
+            buf.append(std::string_view("\n]\n"));
+            write_out();
+        }
+    };
 
-// 定期的にロガーをフラッシュしたい場合に使えるヘルパークラス
-class flusher{
-private:
-    std::weak_ptr<logger> lgr;
-    std::atomic<bool> flusher_thread_run;
-    std::unique_ptr<std::thread> flusher_thread = nullptr;
-public:
-    flusher(std::weak_ptr<logger> logger_weak_ptr) : lgr(logger_weak_ptr), flusher_thread_run(false) {
-        if (auto l = lgr.lock()){
-            assert(l->async_mode);
+#if !(defined(_WIN32) || defined(_WIN64))
+    // 固定サイズのセグメントファイルをメモリマップし、整形したログを直接コピーするsink。
+    // flush時にwriteシステムコールを発行しない。ダーティページはカーネルが保持するため、
+    // コピー済みのログはプロセスがクラッシュしても失われない。
+    //
+    // セグメントの先頭header_sizeバイトはヘッダで、magic(8byte) / version(4byte) / reserved(4byte) / committed(8byte)
+    // の順に並ぶ。committedはヘッダ以降に書き込み済みのバイト数で、ログ1件ごとに更新される。
+    // セグメントが満杯になると、使用分に切り詰めて次のセグメント "<stem>.<index><ext>" に移る。
+    // 既存のセグメントは上書きしない（クラッシュ後に再起動しても、残ったログは残したまま空いている番号から書き始める）。
+    // セグメントを作成できなかった場合は、retry_intervalごとに作成を再試行する。
+    struct mmap_file_sink : public sink{
+    public:
+        static constexpr size_t header_size = 64;
+        static constexpr char magic[8] = {'A','L','G','L','O','G','M','M'};
+        static constexpr uint32_t version = 1;
+        static constexpr std::chrono::seconds retry_interval{1};
+
+    private:
+        const std::string base_name;
+        const size_t segment_size;
+        uint64_t index = 0;
+        std::chrono::steady_clock::time_point next_retry{};
+        int fd = -1;
+        char* map = nullptr;
+        uint64_t committed = 0;
+        fmt::memory_buffer line;
+
+        std::atomic<uint64_t>* committed_field(){
+            return reinterpret_cast<std::atomic<uint64_t>*>(map + 16);
         }
-    }
-    ~flusher(){
-        if(flusher_thread){
-            flusher_thread_run = false;
-            flusher_thread->join(); // 終了まで待機
+
+        bool open_segment(){
+            std::string path;
+            while (true){
+                path = detail::segment_path(base_name, index);
+                fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+                if (fd >= 0){
+                    break;
+                }
+                if (errno != EEXIST){
+                    next_retry = std::chrono::steady_clock::now() + retry_interval;
+                    return false;
+                }
+                ++index; // 以前の実行が残したセグメント。上書きせずに次の番号を使う
+            }
+        #if defined(__linux__)
+            // 実領域を確保しておくことで、書き込み時のSIGBUS(ENOSPC)を避ける
+            const bool sized = ::posix_fallocate(fd, 0, static_cast<off_t>(segment_size)) == 0;
+        #else
+            const bool sized = ::ftruncate(fd, static_cast<off_t>(segment_size)) == 0;
+        #endif
+            void* p = sized ? ::mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+            if (p == MAP_FAILED){
+                ::close(fd);
+                ::unlink(path.c_str()); // 再試行時に同じ番号で作り直す
+                fd = -1;
+                next_retry = std::chrono::steady_clock::now() + retry_interval;
+                return false;
+            }
+            map = static_cast<char*>(p);
+            std::memcpy(map, magic, sizeof(magic));
+            std::memcpy(map + 8, &version, sizeof(version));
+            new (map + 16) std::atomic<uint64_t>(0);
+            committed = 0;
+            return true;
         }
-    }
 
-    // intervalミリ秒ごとにloggerをフラッシュする。
-    // intervalを短くしすぎるとメインプログラムの挙動に影響が出る可能性がある。
-    void start(int interval_ms = 500){
-        auto interval = std::chrono::milliseconds(interval_ms);
-        flusher_thread_run = true;
-        flusher_thread = std::make_unique<std::thread>([&,interval]{
-            #ifdef ALGLOG_INTERNAL_ON
-                if (auto l = lgr.lock()){
-                    l->raw_store(level::debug, "[alglog] start periodic flashing");
+        void close_segment(){
+            if (map){
+                ::munmap(map, segment_size);
+                map = nullptr;
+            }
+            if (fd >= 0){
+                if (::ftruncate(fd, static_cast<off_t>(header_size + committed)) != 0){
+                    count_error(); // 未使用の領域が残るだけで、committedまでのログは読める
                 }
-            #endif
-            set_thread_priority_lowest();
+                ::close(fd);
+                fd = -1;
+            }
+        }
 
-            while(flusher_thread_run){
-                std::this_thread::sleep_for(std::chrono::milliseconds(interval));
-                if (auto l = lgr.lock()){
-                    l->flush();
-                }else{
-                    break; // loggerが解放された場合、flusherのスレッドも終了する
+        void append(const char* p, size_t n){
+            const size_t capacity = segment_size - header_size;
+            if (n > capacity){
+                n = capacity;
+            }
+            if (map && committed + n > capacity){
+                close_segment();
+                ++index;
+                open_segment();
+            }
+            if (!map && std::chrono::steady_clock::now() >= next_retry){
+                open_segment();
+            }
+            if (!map){
+                count_error();
+                return;
+            }
+            std::memcpy(map + header_size + committed, p, n);
+            committed += n;
+            committed_field()->store(committed, std::memory_order_release);
+            count_bytes(n);
+        }
+
+    public:
+        mmap_file_sink(const std::string& base_name, size_t segment_size = 64 * 1024 * 1024)
+            : base_name(base_name), segment_size(std::max<size_t>(segment_size, header_size * 2))
+        {
+            this->valve = valve::always_open;
+            this->formatter = formatter::full;
+            open_segment();
+        }
+        void output(const log_t& l) override {
+            line.clear();
+            format_to(l, line);
+            line.push_back('\n');
+            append(line.data(), line.size());
+        }
+
+        bool is_open() const {
+            return map != nullptr;
+        }
+        // 現在書き込み中のセグメントのパス
+        std::string current_path() const {
+            return detail::segment_path(base_name, index);
+        }
+        // セグメントへコピーしたバイト数
+        uint64_t bytes_written() const {
+            return stats().bytes;
+        }
+
+        ~mmap_file_sink(){
+            close_segment();
+        }
+    };
+
+    // socket_sinkの接続先の種類
+    enum class socket_kind{
+        unix_stream, // addressはソケットファイルのパス
+        unix_datagram, // 同上
+        udp // addressは "host:port"（生成時に一度だけ名前解決する）
+    };
+
+    // ローカルのログ転送エージェント等へ、ソケットでログを送るsink（POSIXのみ）。
+    // 整形したログ（改行区切り）はまず送信待ちのバックログに積まれ、出力のたびにノンブロッキングで送信される。
+    //  - streamでは、バックログの連続領域をまとめて1回のsendで送る。
+    //  - datagramでは、max_datagramバイトに収まるだけのログを1つのデータグラムに詰め、Linuxではsendmmsgでまとめて送る。
+    // 接続できない・相手が詰まっている間もflushを止めないよう、送れなかった分はbacklog_bytesまで保持し、
+    // retry_interval_msごとに再接続を試みる。バックログが満杯のときは新しいログを破棄する（dropped()で確認できる）。
+    struct socket_sink : public sink{
+    private:
+        const socket_kind kind;
+        const std::string address;
+        const size_t max_datagram;
+        const size_t backlog_bytes;
+        const std::chrono::milliseconds retry_interval;
+        int fd = -1;
+        std::chrono::steady_clock::time_point next_retry{};
+        sockaddr_storage addr{};
+        socklen_t addr_len = 0;
+
+        std::string backlog; // 送信待ちのログ。先頭のheadバイトは送信済み
+        size_t head = 0;
+        std::deque<uint32_t> records; // バックログ内の各ログの長さ
+        size_t partial = 0; // stream : 先頭のログのうち送信済みのバイト数
+        fmt::memory_buffer line;
+        uint64_t dropped_num = 0;
+
+        bool is_stream() const {
+            return kind == socket_kind::unix_stream;
+        }
+
+        void resolve_address(){
+            if (kind == socket_kind::udp){
+                const auto colon = address.rfind(':');
+                if (colon == std::string::npos){
+                    return;
+                }
+                addrinfo hints{};
+                hints.ai_family = AF_UNSPEC;
+                hints.ai_socktype = SOCK_DGRAM;
+                addrinfo* res = nullptr;
+                if (::getaddrinfo(address.substr(0, colon).c_str(), address.substr(colon + 1).c_str(), &hints, &res) == 0 && res){
+                    std::memcpy(&addr, res->ai_addr, res->ai_addrlen);
+                    addr_len = static_cast<socklen_t>(res->ai_addrlen);
+                    ::freeaddrinfo(res);
                 }
+                return;
             }
-        });
-    }
-    void stop(){
-        flusher_thread_run = false;
-    }
-};
+            sockaddr_un un{};
+            if (address.size() >= sizeof(un.sun_path)){
+                return;
+            }
+            un.sun_family = AF_UNIX;
+            std::memcpy(un.sun_path, address.c_str(), address.size() + 1);
+            std::memcpy(&addr, &un, sizeof(un));
+            addr_len = static_cast<socklen_t>(sizeof(un));
+        }
 
-// ------------------------------------
+        void close_socket(){
+            if (fd >= 0){
+                ::close(fd);
+                fd = -1;
+            }
+            next_retry = std::chrono::steady_clock::now() + retry_interval;
+        }
 
+        // 未接続であれば、前回の失敗からretry_intervalが経過している場合のみ接続を試みる。ブロックしない。
+        bool ensure_connected(){
+            if (fd >= 0){
+                return true;
+            }
+            if (addr_len == 0 || std::chrono::steady_clock::now() < next_retry){
+                return false;
+            }
+            const int type = is_stream() ? SOCK_STREAM : SOCK_DGRAM;
+            fd = ::socket(addr.ss_family, type, 0);
+            if (fd < 0){
+                close_socket();
+                return false;
+            }
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+            ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+        #if defined(SO_NOSIGPIPE)
+            int on = 1;
+            ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+        #endif
+            if (::connect(fd, reinterpret_cast<const sockaddr*>(&addr), addr_len) != 0 && errno != EINPROGRESS){
+                close_socket();
+                return false;
+            }
+            return true;
+        }
 
-namespace builtin{
+        static int send_flags(){
+        #if defined(MSG_NOSIGNAL)
+            return MSG_DONTWAIT | MSG_NOSIGNAL;
+        #else
+            return MSG_DONTWAIT;
+        #endif
+        }
 
-    namespace formatter{
-        // リリース時コンソール出力向けのフォーマッタ
-        const auto simple = [](const log_t& l) -> std::string {
-            return fmt::format("[{:%F %T}] [{}] | {}",
-                l.time, l.get_level_str(), l.msg );
-        };
-        // デバッグ時ファイル出力向けのフォーマッタ。全てのパラメータを出力する
-        const auto full = [](const log_t& l) -> std::string {
-            return fmt::format("[{:%F %T}] [{}] [process {:>8}] [thread {:>8}] [{:>24}:{:<4}({:>24})] | {}",
-                l.time, l.get_level_str(), l.pid, l.tid, l.loc.file, l.loc.line, l.loc.func, l.msg );
-            // ref : https://cpprefjp.github.io/reference/chrono/format.html
-        };
-        // デバッグ時コンソール出力向けのフォーマッタ
-        const auto console = [](const log_t& l) -> std::string {
-            return fmt::format("[{:%T}] [{}] [{:>24}: {:<4}({:>24})] | {}",
-                l.time, l.get_level_str(), l.loc.file, l.loc.line, l.loc.func, l.msg );
-        };
+        // 送れなかった理由が一時的なもの（相手のバッファが満杯・接続処理中）であればtrue
+        static bool would_block(){
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS || errno == ENOTCONN || errno == ENOBUFS;
+        }
 
-    }
+        void consume(size_t n){
+            head += n;
+            count_bytes(n);
+            const size_t start = head - partial; // 途中まで送ったログは、送り直せるよう先頭から残す
+            if (start == backlog.size()){
+                backlog.clear();
+                head = 0;
+            }else if (start > backlog.size() / 2){
+                backlog.erase(0, start);
+                head -= start;
+            }
+        }
 
-// valve
-    namespace valve{
-        const auto always_open = [](const log_t&){return true;};
-        const auto except_trace = [](const log_t& l){if (l.lvl != level::trace) {return true;} else {return false;}};
-        const auto release_only = [](const log_t& l){if (static_cast<int>(l.lvl) <= static_cast<int>(level::info)) {return true;} else {return false;}}; // リリースモードのシミュレートをするだけでバイナリからは消えない。
-        const auto debug_only = [](const log_t& l){if (static_cast<int>(level::critical) <= static_cast<int>(l.lvl)) {return true;} else {return false;}}; // デバッグモードのシミュレートをするだけでバイナリからは消えない。
-    }
+        void send_stream(){
+            while (head < backlog.size()){
+                const auto n = ::send(fd, backlog.data() + head, backlog.size() - head, send_flags());
+                if (n < 0){
+                    if (errno == EINTR){
+                        continue;
+                    }
+                    if (!would_block()){
+                        // 途中まで送ったログは、再接続後に先頭から送り直す
+                        head -= partial;
+                        partial = 0;
+                        count_error();
+                        close_socket();
+                    }
+                    return;
+                }
+                partial += static_cast<size_t>(n);
+                while (!records.empty() && partial >= records.front()){
+                    partial -= records.front();
+                    records.pop_front();
+                }
+                consume(static_cast<size_t>(n));
+            }
+        }
 
-// sink
-    struct file_sink : public sink{
-        std::unique_ptr<std::ofstream> ofs;
-        file_sink(const std::string& file_name) : ofs(std::make_unique<std::ofstream>(file_name)) {
+        void send_datagrams(){
+            static constexpr size_t max_batch = 64;
+            while (!records.empty()){
+                // バックログの先頭から、max_datagramに収まるだけのログを1つのデータグラムにまとめる
+                std::array<iovec, max_batch> iov{};
+                std::array<size_t, max_batch> nrec{};
+                size_t count = 0;
+                size_t offset = head;
+                size_t r = 0;
+                while (count < max_batch && r < records.size()){
+                    size_t len = 0;
+                    size_t k = 0;
+                    while (r + k < records.size() && (k == 0 || len + records[r + k] <= max_datagram)){
+                        len += records[r + k];
+                        ++k;
+                    }
+                    iov[count].iov_base = &backlog[offset];
+                    iov[count].iov_len = std::min(len, max_datagram); // 1件でmax_datagramを超えるログは切り詰める
+                    nrec[count] = k;
+                    offset += len;
+                    r += k;
+                    ++count;
+                }
+                size_t sent = 0;
+                bool hard_error = false; // errnoは送信が失敗したときのみ有効なので、その場で判定する
+            #if defined(__linux__)
+                std::array<mmsghdr, max_batch> msgs{};
+                for (size_t i = 0; i < count; ++i){
+                    msgs[i].msg_hdr.msg_iov = &iov[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+                }
+                // 一部だけ送れた場合は送った数が返り、errnoは設定されない。残りは次回に送る。
+                const int n = ::sendmmsg(fd, msgs.data(), static_cast<unsigned int>(count), send_flags());
+                if (n > 0){
+                    sent = static_cast<size_t>(n);
+                }else if (n < 0){
+                    hard_error = errno != EINTR && !would_block();
+                }
+            #else
+                for (; sent < count; ++sent){
+                    if (::send(fd, iov[sent].iov_base, iov[sent].iov_len, send_flags()) < 0){
+                        hard_error = errno != EINTR && !would_block();
+                        break;
+                    }
+                }
+            #endif
+                for (size_t i = 0; i < sent; ++i){
+                    size_t len = 0;
+                    for (size_t k = 0; k < nrec[i]; ++k){
+                        len += records.front();
+                        records.pop_front();
+                    }
+                    consume(len);
+                }
+                if (sent < count){
+                    if (hard_error){
+                        count_error();
+                        close_socket();
+                    }
+                    return;
+                }
+            }
+        }
+
+        void send_backlog(){
+            if (head == backlog.size() || !ensure_connected()){
+                return;
+            }
+            if (is_stream()){
+                send_stream();
+            }else{
+                send_datagrams();
+            }
+        }
+
+    public:
+        socket_sink(socket_kind kind, const std::string& address, size_t max_datagram = 1400, size_t backlog_bytes = 1024 * 1024, int retry_interval_ms = 1000)
+            : kind(kind), address(address), max_datagram(std::max<size_t>(max_datagram, 1)), backlog_bytes(backlog_bytes), retry_interval(retry_interval_ms)
+        {
             this->valve = valve::always_open;
             this->formatter = formatter::full;
+            resolve_address();
+            ensure_connected();
         }
         void output(const log_t& l) override {
-            (*ofs.get()) << formatter(l) << std::endl;
+            output_batch(span<const log_t>(&l, 1));
         }
-        virtual ~file_sink() {
-            if (ofs){
-                ofs->flush();
+        void output_batch(span<const log_t> ls) override {
+            for (const auto& l : ls){
+                line.clear();
+                format_to(l, line);
+                line.push_back('\n');
+                if (backlog.size() - head + line.size() > backlog_bytes){
+                    ++dropped_num;
+                    count_error();
+                    continue;
+                }
+                backlog.append(line.data(), line.size());
+                records.push_back(static_cast<uint32_t>(line.size()));
+            }
+            send_backlog();
+        }
+
+        // 接続済みか
+        bool is_connected() const {
+            return fd >= 0;
+        }
+        // 送信待ちのバイト数
+        size_t backlog_size() const {
+            return backlog.size() - head;
+        }
+        // バックログが満杯で破棄したログの数
+        uint64_t dropped() const {
+            return dropped_num;
+        }
+
+        ~socket_sink(){
+            send_backlog(); // 送れる分だけ送る（ブロックしない）
+            if (fd >= 0){
+                ::close(fd);
             }
         }
     };
+#endif
 
     struct print_sink : public sink{
         print_sink(){
@@ -583,7 +4917,22 @@ namespace builtin{
             this->formatter = formatter::console;
         }
         void output(const log_t& l) override {
-            std::cout << formatter(l) << std::endl;
+            output_batch(span<const log_t>(&l, 1));
+        }
+        void output_batch(span<const log_t> ls) override {
+            fmt::memory_buffer buf;
+            for (const auto& l : ls){
+                format_to(l, buf);
+                buf.push_back('\n');
+            }
+            std::cout.write(buf.data(), static_cast<std::streamsize>(buf.size()));
+            std::cout.flush();
+            if (std::cout){
+                count_bytes(buf.size());
+            }else{
+                count_error();
+                std::cout.clear();
+            }
         }
     };
 
@@ -598,34 +4947,162 @@ namespace builtin{
     }
 
     struct color_print_sink : public print_sink{
-        void output(const log_t& l) override {
-            auto fg_color = fmt::color::white;
-            switch(l.lvl){
+        static fmt::color level_color(level lvl){
+            switch(lvl){
                 case level::error:
-                    fg_color = static_cast<fmt::color>(color::watermelon_red);
-                    break;
+                    return static_cast<fmt::color>(color::watermelon_red);
                 case level::alert:
-                    fg_color = static_cast<fmt::color>(color::mellow_apricot);
-                    break;
+                    return static_cast<fmt::color>(color::mellow_apricot);
                 case level::info:
-                    fg_color = static_cast<fmt::color>(color::pearl_aqua);
-                    break;
+                    return static_cast<fmt::color>(color::pearl_aqua);
                 case level::critical:
-                    fg_color = static_cast<fmt::color>(color::watermelon_red);
-                    break;
+                    return static_cast<fmt::color>(color::watermelon_red);
                 case level::warn:
-                    fg_color = static_cast<fmt::color>(color::caramel);
-                    break;
+                    return static_cast<fmt::color>(color::caramel);
                 case level::debug:
-                    fg_color = static_cast<fmt::color>(color::moonstone);
-                    break;
+                    return static_cast<fmt::color>(color::moonstone);
                 case level::trace:
-                    fg_color = fmt::color::light_slate_gray;
-                    break;
+                    return fmt::color::light_slate_gray;
                 default:
-                    break; 
+                    return fmt::color::white;
+            }
+        }
+        void output(const log_t& l) override {
+            output_batch(span<const log_t>(&l, 1));
+        }
+        void output_batch(span<const log_t> ls) override {
+            fmt::memory_buffer buf;
+            fmt::memory_buffer line;
+            for (const auto& l : ls){
+                line.clear();
+                format_to(l, line);
+                fmt::format_to(std::back_inserter(buf), fg(level_color(l.lvl)), "{}\n", fmt::string_view(line.data(), line.size()));
+            }
+            if (std::fwrite(buf.data(), 1, buf.size(), stdout) == buf.size()){
+                count_bytes(buf.size());
+            }else{
+                count_error();
+            }
+            std::fflush(stdout);
+        }
+    };
+
+    // 別のsinkを専用のワーカースレッドで出力するラッパ。
+    // loggerのflushはキューへのコピーだけで戻るため、遅いsink（端末やパイプへの出力など）が
+    // 他のsinkやアプリケーションのスレッドを止めなくなる。
+    // キューが満杯のときの振る舞いはpolicyで指定する（spillの場合は上限なし）。
+    // キューに積むかどうかはこのラッパ自身のaccepted_levelsで判断する。生成時に内側のsinkの値を複製するのみで、
+    // 以後内側のsinkのaccepted_levelsを変更しても追従しない（狭めた分は、ワーカー側で内側のsinkが改めて除外する）。
+    // 受け付けるレベルを変える場合は、ラッパのaccepted_levelsを変更してlogger::update_level_mask()を呼ぶこと。
+    //
+    // 例 : lgr->connect_sink(std::make_shared<alglog::builtin::async_sink>(std::make_shared<alglog::builtin::color_print_sink>()));
+    struct async_sink : public sink{
+    private:
+        std::shared_ptr<sink> inner;
+        const size_t capacity;
+        const overflow_policy policy;
+        std::deque<log_t> queue;
+        std::vector<log_t> work; // ワーカーがキューから取り出した分
+        mutable std::mutex mtx;
+        std::condition_variable not_empty;
+        std::condition_variable not_full;
+        std::condition_variable idle;
+        bool busy = false; // ワーカーが出力中
+        bool run = true;
+        uint64_t dropped_num = 0;
+        std::thread worker;
+
+        void loop(){
+            std::unique_lock<std::mutex> lock(mtx);
+            while (true){
+                not_empty.wait(lock, [&]{ return !run || !queue.empty(); });
+                if (queue.empty()){
+                    break; // 停止要求があり、全て出力済み
+                }
+                const size_t n = std::min(queue.size(), logger::flush_batch_size);
+                work.clear();
+                std::move(queue.begin(), queue.begin() + static_cast<std::ptrdiff_t>(n), std::back_inserter(work));
+                queue.erase(queue.begin(), queue.begin() + static_cast<std::ptrdiff_t>(n));
+                busy = true;
+                not_full.notify_all();
+                lock.unlock();
+                inner->_cond_output_batch(span<const log_t>(work.data(), work.size()));
+                lock.lock();
+                busy = false;
+                if (queue.empty()){
+                    idle.notify_all();
+                }
+            }
+            idle.notify_all();
+        }
+
+        // ロックを保持した状態で呼ぶ。書き込めなければfalseを返す。
+        bool reserve(std::unique_lock<std::mutex>& lock){
+            if (policy == overflow_policy::spill || queue.size() < capacity){
+                return true;
+            }
+            if (policy == overflow_policy::overwrite_oldest){
+                queue.pop_front();
+                ++dropped_num;
+                count_error();
+                return true;
+            }
+            if (policy == overflow_policy::block){
+                if (not_full.wait_for(lock, std::chrono::microseconds(ALGLOG_MPSC_BLOCK_TIMEOUT_US), [&]{ return queue.size() < capacity; })){
+                    return true;
+                }
+            }
+            ++dropped_num;
+            count_error();
+            return false;
+        }
+
+    public:
+        async_sink(std::shared_ptr<sink> inner_sink, size_t capacity = 8192, overflow_policy policy = overflow_policy::block)
+            : inner(std::move(inner_sink)), capacity(capacity), policy(policy) {
+            this->accepted_levels = inner->accepted_levels; // 初期値のみ複製する。valveはワーカー側で内側のsinkが判断する
+            worker = std::thread([this]{ loop(); });
+        }
+        ~async_sink(){
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                run = false;
+            }
+            not_empty.notify_all();
+            worker.join(); // 残っているログは全て出力してから終了する
+        }
+
+        void output(const log_t& l) override {
+            output_batch(span<const log_t>(&l, 1));
+        }
+        void output_batch(span<const log_t> ls) override {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                for (const auto& l : ls){
+                    if (reserve(lock)){
+                        queue.push_back(l);
+                    }
+                }
             }
-            fmt::print(fg(fg_color), formatter(l) + "\n");
+            not_empty.notify_one();
+        }
+
+        // キューが空になり、ワーカーが出力を終えるまで待機する。
+        void drain(){
+            std::unique_lock<std::mutex> lock(mtx);
+            idle.wait(lock, [&]{ return queue.empty() && !busy; });
+        }
+
+        // 出力待ちのログの数
+        size_t queue_depth() const {
+            std::lock_guard<std::mutex> lock(mtx);
+            return queue.size();
+        }
+
+        // キューが満杯で破棄されたログの累計数
+        uint64_t dropped() const {
+            std::lock_guard<std::mutex> lock(mtx);
+            return dropped_num;
         }
     };
 
@@ -663,9 +5140,152 @@ public:
 };
 
 
+// -------------------------------------------------------
+// トレーススパン
+
+// trace_spanの引数。構造化ログのフィールドと同じく、キーと値の組。
+using span_arg = field;
+
+namespace detail{
+    // スレッドごとのスパンの入れ子
+    struct span_stack{
+        uint64_t current = 0; // 実行中の最も内側のスパンのID
+        uint32_t depth = 0;
+        uint32_t counter = 0;
+    };
+    inline span_stack& current_span_stack(){
+        thread_local span_stack st;
+        return st;
+    }
+}
+
+// スコープの開始と終了をトレーススパンとして記録する。time_counterと異なり、ログ2件の時刻の差から経過時間を求める。
+// 時刻はloggerの時刻取得（ALGLOG_TSC_CLOCKではTSC）で付与され、同一スレッドのスパンは入れ子として親子関係が記録される。
+// 記録されたスパンはbuiltin::chrome_trace_sinkでtrace viewerに読み込める形式で出力できる。
+// lvlのログがコンパイルスイッチ（ALGLOG_*_ON）または実行時（set_level等）に無効であれば、何も記録しない。
+// 名前や引数の構築も含めて取り除きたい場合は、ALGLOG_SPANマクロを使う。
+//
+// loggerはtrace_spanより長く生存させること（負荷を抑えるため、trace_spanはloggerの所有権を持たない）。
+//
+// 例 : alglog::trace_span s(lgr, "decode", {{"frame", 42}});
+//      s.arg("bytes", n); // 終了時の引数として記録される
+class trace_span{
+private:
+    logger* lgr = nullptr;
+    source_location loc;
+    level lvl;
+    span_info info;
+    fmt::memory_buffer end_msg; // 終了時のメッセージ。スパン名に続けて、argで追加された引数が入る
+    bool has_end_args = false;
+
+    void append_args(fmt::memory_buffer& buf, std::initializer_list<span_arg> args){
+        bool first = true;
+        for (const auto& a : args){
+            buf.push_back(first ? '{' : ',');
+            first = false;
+            a.append_to(buf);
+        }
+        if (!first){
+            buf.push_back('}');
+        }
+    }
+
+    void begin(std::string_view name, std::initializer_list<span_arg> args){
+        if (!is_compiled(lvl) || !lgr->is_enabled(lvl)){
+            lgr = nullptr;
+            return;
+        }
+        auto& st = detail::current_span_stack();
+        info.phase = 'B';
+        info.name_len = static_cast<uint16_t>(std::min<size_t>(name.size(), std::numeric_limits<uint16_t>::max()));
+        name = name.substr(0, info.name_len);
+        info.depth = st.depth;
+        info.parent = st.current;
+        info.id = ((static_cast<uint64_t>(current_thread_index()) + 1) << 32) | ++st.counter;
+        st.current = info.id;
+        ++st.depth;
+
+        fmt::memory_buffer buf;
+        buf.append(name);
+        if (args.size() != 0){
+            buf.push_back(' ');
+            append_args(buf, args);
+        }
+        lgr->span_store(loc, lvl, info, std::string_view(buf.data(), buf.size()));
+        end_msg.append(name); // nameは呼び出し元の一時オブジェクトでありうるため、複製しておく
+    }
+
+public:
+    trace_span(const std::shared_ptr<logger>& lgr, source_location loc, std::string_view name, std::initializer_list<span_arg> args = {}, level lvl = level::debug)
+        : lgr(lgr.get()), loc(loc), lvl(lvl) {
+        begin(name, args);
+    }
+    trace_span(const std::shared_ptr<logger>& lgr, std::string_view name, std::initializer_list<span_arg> args = {}, level lvl = level::debug)
+        : trace_span(lgr, source_location{}, name, args, lvl) {}
+    trace_span(const trace_span&) = delete;
+    trace_span& operator=(const trace_span&) = delete;
+
+    // 終了時に記録する引数を追加する。
+    template <class T>
+    trace_span& arg(std::string_view key, const T& value){
+        if (lgr){
+            end_msg.append(has_end_args ? std::string_view(",") : std::string_view(" {"));
+            has_end_args = true;
+            span_arg(key, value).append_to(end_msg);
+        }
+        return *this;
+    }
+
+    // 記録中であればtrue
+    bool is_active() const {
+        return lgr != nullptr;
+    }
+
+    const span_info& get_info() const {
+        return info;
+    }
+
+    ~trace_span(){
+        if (!lgr){
+            return;
+        }
+        auto& st = detail::current_span_stack();
+        st.current = info.parent;
+        --st.depth;
+
+        info.phase = 'E';
+        if (has_end_args){
+            end_msg.push_back('}');
+        }
+        lgr->span_store(loc, lvl, info, std::string_view(end_msg.data(), end_msg.size()));
+    }
+};
+
+// ALGLOG_DEBUG_ONが定義されていないときにALGLOG_SPANが生成する、何もしないスパン。
+struct null_span{
+    template <class T>
+    null_span& arg(std::string_view, const T&){
+        return *this;
+    }
+    bool is_active() const {
+        return false;
+    }
+};
+
+// debugレベルのトレーススパンを変数varとして生成する。ALGLOG_DEBUG_ONが定義されていない場合はnull_spanとなり、
+// 名前や引数は評価されない。
+// 例 : ALGLOG_SPAN(s, lgr, "decode", {{"frame", 42}});
+#ifdef ALGLOG_DEBUG_ON
+    #define ALGLOG_SPAN(var, lgr, ...) alglog::trace_span var(lgr, ALGLOG_SR, __VA_ARGS__)
+#else
+    #define ALGLOG_SPAN(var, lgr, ...) alglog::null_span var
+#endif
+
 // -------------------------------------------------------
 
-#define ALGLOG_SR alglog::source_location{__ALGLOG_FNAME__, __LINE__, __func__}
+// 出力箇所の記述子を返す。展開ごとに静的な記述子が1つ作られ、初回の呼び出し時に登録される。
+// alglog::source_locationへ暗黙に変換できる。
+#define ALGLOG_SR ([](const char* f) -> alglog::callsite& { static alglog::callsite cs{__ALGLOG_FNAME__, __LINE__, f}; return cs; }(__func__))
 
 
 } // end namespace alglog
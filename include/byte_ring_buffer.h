@@ -0,0 +1,131 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifdef _MSC_VER
+#pragma warning(disable:4324)
+#endif
+
+/**
+ * @tparam N   バッファサイズ（バイト、2 のべき乗であること）
+ *
+ * 可変長レコードを格納する「複数 Producer / 単一 Consumer」のバイトリングバッファ。
+ * レコードは [ヘッダ(16byte) | ペイロード] の形で連続領域に確保され、
+ * 必要なバイト数だけを消費する。末尾に収まらない場合はパディングレコードを挟んで先頭から確保する。
+ *
+ *  - reserve():  ペイロード領域を確保する。満杯なら nullptr（Producer）
+ *  - commit():   書き込み完了を公開する（Producer）
+ *  - front():    先頭レコードのペイロード、未公開・空なら nullptr（Consumer）
+ *  - release():  先頭レコードを解放する（Consumer）
+ *
+ * 使い方例:
+ *   byte_ring_buffer<4096> q;
+ *   if (void* p = q.reserve(5)) { std::memcpy(p, "hello", 5); q.commit(p); }
+ *   std::size_t n;
+ *   if (void* p = q.front(n)) { ...; q.release(); }
+ */
+template<std::size_t N>
+class byte_ring_buffer {
+    static_assert((N & (N - 1)) == 0, "N must be a power of two");
+
+public:
+    static constexpr std::size_t align = 16;
+    static constexpr std::size_t header_size = 16;
+    // 1レコードのペイロード上限。これを超えるレコードは確保できない。
+    static constexpr std::size_t max_payload = N / 4 - header_size;
+
+private:
+    static_assert(N / 4 > header_size, "N is too small");
+
+    static constexpr std::uint32_t committed_bit = 1u << 31;
+    static constexpr std::uint32_t padding_bit = 1u << 30;
+    static constexpr std::uint32_t size_mask = padding_bit - 1;
+    static constexpr std::size_t mask_ = N - 1;
+
+    alignas(64) unsigned char buf_[N] = {};
+    alignas(64) std::atomic<std::size_t> head_{0};   // producer 用
+    alignas(64) std::atomic<std::size_t> tail_{0};   // consumer が書き込む
+
+    static constexpr std::size_t round_up(std::size_t n) noexcept {
+        return (n + align - 1) & ~(align - 1);
+    }
+
+    std::atomic<std::uint32_t>* header_at(std::size_t pos) noexcept {
+        return reinterpret_cast<std::atomic<std::uint32_t>*>(&buf_[pos & mask_]);
+    }
+
+public:
+    byte_ring_buffer() = default;
+    byte_ring_buffer(const byte_ring_buffer&) = delete;
+    byte_ring_buffer& operator=(const byte_ring_buffer&) = delete;
+
+    /** Producer: ペイロード領域を確保する */
+    void* reserve(std::size_t payload) noexcept {
+        if (payload > max_payload)
+            return nullptr;
+        const std::size_t need = round_up(header_size + payload);
+        std::size_t h = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            const std::size_t t = tail_.load(std::memory_order_acquire);
+            const std::size_t contiguous = N - (h & mask_);
+            const std::size_t pad = (need > contiguous) ? contiguous : 0;
+            if (h + pad + need - t > N)
+                return nullptr;          // バッファ満杯
+            if (head_.compare_exchange_weak(h, h + pad + need,
+                    std::memory_order_acq_rel, std::memory_order_relaxed))
+            {
+                if (pad) {
+                    // 末尾の残りをパディングとして即座に公開する
+                    header_at(h)->store(static_cast<std::uint32_t>(pad) | committed_bit | padding_bit,
+                        std::memory_order_release);
+                    h += pad;
+                }
+                unsigned char* rec = &buf_[h & mask_];
+                const auto len = static_cast<std::uint32_t>(need);
+                std::memcpy(rec + sizeof(std::uint32_t), &len, sizeof(len));
+                return rec + header_size;
+            }
+            // CAS に負けたので h は更新されている。ループ続行
+        }
+    }
+
+    /** Producer: reserve() で確保した領域の書き込み完了を公開する */
+    void commit(void* payload) noexcept {
+        unsigned char* rec = static_cast<unsigned char*>(payload) - header_size;
+        std::uint32_t need;
+        std::memcpy(&need, rec + sizeof(std::uint32_t), sizeof(std::uint32_t));
+        reinterpret_cast<std::atomic<std::uint32_t>*>(rec)->store(need | committed_bit, std::memory_order_release);
+    }
+
+    /** Consumer: 先頭レコードのペイロードを参照する */
+    void* front(std::size_t& payload_capacity) noexcept {
+        for (;;) {
+            const std::size_t t = tail_.load(std::memory_order_relaxed);
+            const std::uint32_t v = header_at(t)->load(std::memory_order_acquire);
+            if (!(v & committed_bit))
+                return nullptr;          // 空、もしくは書き込み中
+            if (v & padding_bit) {
+                discard(t, v & size_mask);
+                continue;
+            }
+            payload_capacity = (v & size_mask) - header_size;
+            return &buf_[(t & mask_) + header_size];
+        }
+    }
+
+    /** Consumer: 先頭レコードを解放する */
+    void release() noexcept {
+        const std::size_t t = tail_.load(std::memory_order_relaxed);
+        const std::uint32_t v = header_at(t)->load(std::memory_order_relaxed);
+        discard(t, v & size_mask);
+    }
+
+private:
+    void discard(std::size_t t, std::size_t size) noexcept {
+        // 次の周回でヘッダ位置になりうるため、領域をゼロクリアしてから返却する
+        std::memset(&buf_[t & mask_], 0, size);
+        tail_.store(t + size, std::memory_order_release);
+    }
+};
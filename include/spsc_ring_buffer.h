@@ -0,0 +1,109 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+#ifdef _MSC_VER
+#pragma warning(disable:4324)
+#endif
+
+/**
+ * @tparam T   要素型
+ * @tparam N   バッファサイズ（2 のべき乗であること）
+ *
+ * 単一 Producer / 単一 Consumer の wait-free リングバッファ。
+ * 相手側のインデックスをローカルにキャッシュし、共有キャッシュラインの読み込みを減らす。
+ *
+ *  - push():  成功なら true、満杯なら false（Producer 専用）
+ *  - front(): 先頭要素へのポインタ、空なら nullptr（Consumer 専用）
+ *  - pop():   成功なら true、空なら false（Consumer 専用）
+ *
+ * 使い方例:
+ *   spsc_ring_buffer<int, 1024> q;
+ *   q.push(42);
+ *   int v;
+ *   if (q.pop(v)) { ... }
+ */
+template<typename T, std::size_t N>
+class spsc_ring_buffer {
+    static_assert((N & (N - 1)) == 0, "N must be a power of two");
+
+    using storage_t = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+
+    storage_t buf_[N];
+
+    alignas(64) std::atomic<std::size_t> head_{0};   // producer が書き込む
+    std::size_t tail_cache_{0};                       // producer から見た tail のキャッシュ
+
+    alignas(64) std::atomic<std::size_t> tail_{0};   // consumer が書き込む
+    std::size_t head_cache_{0};                       // consumer から見た head のキャッシュ
+
+    static constexpr std::size_t mask_ = N - 1;
+
+    T* at(std::size_t i) noexcept {
+        return reinterpret_cast<T*>(&buf_[i & mask_]);
+    }
+
+public:
+    spsc_ring_buffer() = default;
+    spsc_ring_buffer(const spsc_ring_buffer&) = delete;
+    spsc_ring_buffer& operator=(const spsc_ring_buffer&) = delete;
+
+    ~spsc_ring_buffer() {
+        // 残っている要素を破棄
+        std::size_t t = tail_.load(std::memory_order_relaxed);
+        const std::size_t h = head_.load(std::memory_order_acquire);
+        for (; t != h; ++t)
+            at(t)->~T();
+    }
+
+    /** Producer: エンキュー */
+    bool push(const T& v) noexcept {
+        return emplace(v);
+    }
+    bool push(T&& v) noexcept {
+        return emplace(std::move(v));
+    }
+
+    /** Consumer: 先頭要素を参照する */
+    T* front() noexcept {
+        const std::size_t t = tail_.load(std::memory_order_relaxed);
+        if (t == head_cache_) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (t == head_cache_)
+                return nullptr;         // 空
+        }
+        return at(t);
+    }
+
+    /** Consumer: デキュー */
+    bool pop(T& out) noexcept {
+        T* p = front();
+        if (!p)
+            return false;
+        out = std::move(*p);
+        p->~T();
+        tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Consumer: 空かどうか */
+    bool empty() noexcept {
+        return front() == nullptr;
+    }
+
+private:
+    template<typename U>
+    bool emplace(U&& v) noexcept {
+        const std::size_t h = head_.load(std::memory_order_relaxed);
+        if (h - tail_cache_ == N) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (h - tail_cache_ == N)
+                return false;           // バッファ満杯
+        }
+        new (at(h)) T(std::forward<U>(v));
+        head_.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
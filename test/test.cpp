@@ -2,9 +2,57 @@
 #include <iostream>
 #include <random>
 #include <thread>
+#if !(defined(_WIN32) || defined(_WIN64))
+    #include <sys/wait.h>
+    #include <sys/stat.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
+#endif
 
 #include "test_multi_include.h"
 
+// 出力されたメッセージを記録するテスト用sink
+struct capture_sink : public alglog::sink{
+    std::vector<std::string> msgs;
+    std::vector<std::chrono::system_clock::time_point> times;
+    capture_sink(){
+        this->valve = alglog::builtin::valve::always_open;
+    }
+    void output(const alglog::log_t& l) override {
+        msgs.push_back(l.msg);
+        times.push_back(l.time);
+    }
+};
+
+// output_batchの呼び出し回数を記録するテスト用sink
+struct batch_count_sink : public capture_sink{
+    int batches = 0;
+    void output_batch(alglog::span<const alglog::log_t> ls) override {
+        ++batches;
+        capture_sink::output_batch(ls);
+    }
+};
+
+// 出力されたログをそのまま記録するテスト用sink
+struct keep_sink : public alglog::sink{
+    std::vector<alglog::log_t>& v;
+    explicit keep_sink(std::vector<alglog::log_t>& v) : v(v) {}
+    void output(const alglog::log_t& l) override { v.push_back(l); }
+};
+
+static int test_failures = 0;
+
+static void check(bool cond, const std::string& name){
+    if (cond){
+        std::cout << "[ OK ] " << name << std::endl;
+    }else{
+        std::cout << "[FAIL] " << name << std::endl;
+        ++test_failures;
+    }
+}
+
 
 int main(){
 
@@ -90,6 +138,973 @@ int main(){
     }
 
 
+    // deferred format test
+    {
+        auto lgr = std::make_shared<alglog::logger>(true, true);
+        auto cap = std::make_shared<capture_sink>();
+        lgr->connect_sink(cap);
+        {
+            std::string s = "owned";
+            const char* p = "literal";
+            lgr->info("{} {} {:.1f} {}", 42, s, 1.25, p);
+            s = "modified"; // 保存された引数はコピーなので影響しない
+        }
+        std::vector<int> v = {1,2,3};
+        lgr->info("vector = {}", v); // 遅延不可能な型は即時フォーマットされる
+        {
+            std::string runtime_fmt = "runtime {} {}";
+            lgr->info(fmt::runtime(runtime_fmt), 1, 2);
+            runtime_fmt.assign(64, 'x'); // フォーマット文字列もコピーされるので影響しない
+        }
+        lgr->flush();
+        check(cap->msgs.size() == 3, "deferred format : count");
+        check(cap->msgs.size() == 3 && cap->msgs[0] == "42 owned 1.2 literal", "deferred format : args");
+        check(cap->msgs.size() == 3 && cap->msgs[1] == "vector = [1, 2, 3]", "deferred format : fallback");
+        check(cap->msgs.size() == 3 && cap->msgs[2] == "runtime 1 2", "deferred format : runtime format string");
+    }
+
+    // batch output test
+    {
+        auto lgr = std::make_shared<alglog::logger>(true);
+        auto all = std::make_shared<batch_count_sink>();
+        auto filtered = std::make_shared<batch_count_sink>();
+        filtered->valve = [](const alglog::log_t& l){ return l.msg != "skip"; };
+        lgr->connect_sink(all);
+        lgr->connect_sink(filtered);
+        for (auto m : {"a", "b", "skip", "c", "skip", "skip", "d"}){
+            lgr->info("{}", m);
+        }
+        lgr->flush();
+        check(all->batches == 1 && all->msgs.size() == 7, "batch output : single batch");
+        check(filtered->batches == 3 && filtered->msgs.size() == 4, "batch output : valve splits runs");
+        const auto skew = std::chrono::system_clock::now() - all->times.back();
+        check(std::chrono::abs(skew) < std::chrono::seconds(1), "timestamp : close to system_clock");
+    }
+
+    // buffered file sink test
+    {
+        auto lgr = std::make_shared<alglog::logger>(true);
+        auto fs = std::make_shared<alglog::builtin::file_sink>("buffered_file_sink.log");
+        auto lazy = std::make_shared<alglog::builtin::file_sink>("buffered_file_sink_lazy.log", alglog::builtin::durability::none);
+        lgr->connect_sink(fs);
+        lgr->connect_sink(lazy);
+        for (int i=0; i<100; ++i){
+            lgr->info("buffered {}", i);
+        }
+        lgr->flush();
+        std::ifstream ifs("buffered_file_sink.log", std::ios::binary | std::ios::ate);
+        check(fs->syscalls() == 1, "file sink : coalesced write");
+        check(fs->bytes_written() > 0 && static_cast<uint64_t>(ifs.tellg()) == fs->bytes_written(), "file sink : bytes written");
+        check(lazy->syscalls() == 0, "file sink : durability none keeps buffer");
+
+        auto unopened = std::make_shared<alglog::builtin::file_sink>("alglog_no_such_dir/file_sink.log");
+        lgr->connect_sink(unopened);
+        const auto open_errors = unopened->stats().errors;
+        lgr->info("lost");
+        lgr->flush();
+        check(!unopened->is_open() && open_errors == 1 && unopened->stats().errors == 2, "file sink : count discarded writes");
+    }
+
+    // rotating file sink test
+    {
+        for (int i=0; i<16; ++i){
+            std::remove(fmt::format("rotating.{}.log", i).c_str());
+        }
+        {
+            auto lgr = std::make_shared<alglog::logger>(true);
+            auto rs = std::make_shared<alglog::builtin::rotating_file_sink>("rotating.log", 4096, std::chrono::seconds(0), 2,
+                alglog::builtin::durability::flush_per_batch, 1024);
+            lgr->connect_sink(rs);
+            for (int i=0; i<100; ++i){
+                lgr->info("rotating {}", i);
+            }
+            lgr->flush();
+        }
+        auto exists = [](const std::string& path){ return std::ifstream(path).good(); };
+        auto size_of = [](const std::string& path){ return static_cast<long long>(std::ifstream(path, std::ios::binary | std::ios::ate).tellg()); };
+        check(!exists("rotating.0.log") && exists("rotating.2.log") && exists("rotating.3.log"), "rotating file sink : retention");
+        check(size_of("rotating.2.log") <= 4096 + 1024, "rotating file sink : segment size");
+        check(!exists("rotating.4.log"), "rotating file sink : unused segment removed");
+
+        // 再起動時は既存のセグメントを上書きせず、次の番号から書き始める。保持数を超えた古いセグメントは削除される。
+        std::ifstream last_ifs("rotating.3.log", std::ios::binary);
+        const std::string last((std::istreambuf_iterator<char>(last_ifs)), std::istreambuf_iterator<char>());
+        last_ifs.close();
+        {
+            auto lgr = std::make_shared<alglog::logger>(true);
+            auto rs = std::make_shared<alglog::builtin::rotating_file_sink>("rotating.log", 4096, std::chrono::seconds(0), 2,
+                alglog::builtin::durability::flush_per_batch, 1024);
+            lgr->connect_sink(rs);
+            check(rs->current_path() == "rotating.4.log", "rotating file sink : resume after existing segments");
+            lgr->info("restarted");
+            lgr->flush();
+        }
+        std::ifstream kept_ifs("rotating.3.log", std::ios::binary);
+        const std::string kept((std::istreambuf_iterator<char>(kept_ifs)), std::istreambuf_iterator<char>());
+        check(!last.empty() && kept == last && !exists("rotating.2.log") && exists("rotating.4.log") && !exists("rotating.5.log"), "rotating file sink : existing segments preserved");
+
+#if !(defined(_WIN32) || defined(_WIN64))
+        // 次のセグメントを作成できない間は、現在のセグメントへの書き込みを続ける
+        std::remove("rotating_fail.0.log");
+        ::mkdir("rotating_fail.1.log", 0755);
+        {
+            auto lgr = std::make_shared<alglog::logger>(true);
+            auto rs = std::make_shared<alglog::builtin::rotating_file_sink>("rotating_fail.log", 1024, std::chrono::seconds(0), 0,
+                alglog::builtin::durability::flush_per_batch, 256);
+            lgr->connect_sink(rs);
+            for (int i=0; i<100; ++i){
+                lgr->info("rotating {}", i);
+                lgr->flush();
+            }
+            check(rs->current_path() == "rotating_fail.0.log" && rs->stats().errors > 0
+                && static_cast<uint64_t>(size_of("rotating_fail.0.log")) == rs->bytes_written(), "rotating file sink : keep writing when next segment fails");
+        }
+        std::remove("rotating_fail.0.log");
+        std::remove("rotating_fail.1.log");
+#endif
+    }
+
+#if !(defined(_WIN32) || defined(_WIN64))
+    // mmap file sink test
+    {
+        for (int i=0; i<16; ++i){
+            std::remove(fmt::format("mmap_sink.{}.log", i).c_str());
+        }
+        uint64_t written = 0;
+        {
+            auto lgr = std::make_shared<alglog::logger>(true);
+            auto ms = std::make_shared<alglog::builtin::mmap_file_sink>("mmap_sink.log", 4096);
+            lgr->connect_sink(ms);
+            for (int i=0; i<100; ++i){
+                lgr->info("mmap {}", i);
+            }
+            lgr->flush();
+            written = ms->bytes_written();
+        }
+        uint64_t total = 0;
+        bool header_ok = true;
+        for (int i=0; ; ++i){
+            std::ifstream ifs(fmt::format("mmap_sink.{}.log", i), std::ios::binary);
+            if (!ifs){
+                break;
+            }
+            std::string content((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+            uint64_t committed = 0;
+            std::memcpy(&committed, content.data() + 16, sizeof(committed));
+            header_ok = header_ok && content.compare(0, 8, "ALGLOGMM") == 0
+                && committed + alglog::builtin::mmap_file_sink::header_size == content.size();
+            total += committed;
+        }
+        check(header_ok, "mmap file sink : segment header");
+        check(written > 4096 && total == written, "mmap file sink : committed length");
+
+        // 再起動時は既存のセグメントを上書きせず、空いている番号から書き始める
+        std::string resumed_path;
+        {
+            alglog::builtin::mmap_file_sink ms("mmap_sink.log", 4096);
+            resumed_path = ms.current_path();
+        }
+        uint64_t preserved = 0;
+        for (int i=0; ; ++i){
+            const auto path = fmt::format("mmap_sink.{}.log", i);
+            if (path == resumed_path){
+                break;
+            }
+            std::ifstream ifs(path, std::ios::binary);
+            if (!ifs){
+                break;
+            }
+            std::string content((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+            preserved += content.size() - alglog::builtin::mmap_file_sink::header_size;
+        }
+        check(preserved == written && std::ifstream(resumed_path).good(), "mmap file sink : existing segments preserved");
+    }
+#endif
+
+    // binary file sink test
+    {
+        std::vector<std::string> expected;
+        {
+            auto lgr = std::make_shared<alglog::logger>(true);
+            auto text = std::make_shared<capture_sink>();
+            text->formatter = alglog::builtin::formatter::simple;
+            auto bs = std::make_shared<alglog::builtin::binary_file_sink>("binary_sink.alglog");
+            lgr->connect_sink(bs);
+            lgr->connect_sink(text);
+            for (int i=0; i<50; ++i){
+                lgr->info("binary {}", i);
+                lgr->raw_store(alglog::source_location{"binary.cpp", i % 3, "func"}, alglog::level::alert, "with location");
+            }
+            lgr->flush();
+            for (const auto& m : text->msgs){
+                expected.push_back(m);
+            }
+        }
+        std::ifstream ifs("binary_sink.alglog", std::ios::binary);
+        alglog::binary::reader r(ifs);
+        alglog::log_t l;
+        uint64_t tid = 0;
+        size_t n = 0;
+        bool same = r.is_valid();
+        while (r.next(l, tid)){
+            same = same && n < expected.size() && l.msg == expected[n];
+            ++n;
+        }
+        check(same && n == expected.size(), "binary file sink : roundtrip");
+        check(l.loc.line == 49 % 3 && std::string(l.loc.file) == "binary.cpp" && l.lvl == alglog::level::alert, "binary file sink : callsite dictionary");
+    }
+
+    // byte ring buffer container test
+    {
+        auto c = std::make_unique<alglog::log_container_mpsc_bytes<4096>>();
+        alglog::log_t head;
+        head.lvl = alglog::level::info;
+        head.pid = 1;
+        head.time = std::chrono::system_clock::now();
+        check(c->push_message(alglog::log_t(head), "short message", nullptr), "byte ring : push");
+        check(c->push_message(alglog::log_t(head), std::string(2000, 'x'), nullptr), "byte ring : push oversized");
+        alglog::log_t l;
+        check(c->pop(l) && l.msg == "short message" && l.time == head.time, "byte ring : roundtrip");
+        const auto marker = alglog::log_container_mpsc_bytes<4096>::truncated_marker;
+        check(c->pop(l) && l.msg.size() < 2000 && l.msg.substr(l.msg.size() - marker.size()) == marker, "byte ring : truncation");
+        check(!c->pop(l), "byte ring : empty");
+        int pushed = 0;
+        while (c->push_message(alglog::log_t(head), "fill", nullptr) && pushed < 1000){
+            ++pushed;
+        }
+        int popped = 0;
+        while (c->pop(l)){
+            ++popped;
+        }
+        check(pushed > 0 && pushed < 1000 && pushed == popped, "byte ring : full and drain");
+    }
+
+    // per-thread container test
+    {
+        auto c = std::make_unique<alglog::log_container_per_thread<8>>();
+        const auto base = std::chrono::system_clock::now();
+        auto make_log = [&](int i){
+            alglog::log_t l;
+            l.msg = std::to_string(i);
+            l.lvl = alglog::level::info;
+            l.time = base + std::chrono::milliseconds(i);
+            return l;
+        };
+        alglog::log_t l;
+        check(!c->pop(l), "per-thread container : empty before registration");
+
+        // 2スレッドが交互のタイムスタンプで書き込み、終了後に取り出す
+        std::thread a([&]{ for (int i=0; i<6; i+=2){ c->push(make_log(i)); } });
+        std::thread b([&]{ for (int i=1; i<6; i+=2){ c->push(make_log(i)); } });
+        a.join();
+        b.join();
+        std::string order;
+        while (c->pop(l)){
+            order += l.msg;
+        }
+        check(order == "012345", "per-thread container : merge order after join");
+
+        // 退役したリングが取り除かれた後も、新しいスレッドは登録して書き込める
+        std::thread d([&]{ c->push(make_log(6)); });
+        d.join();
+        check(c->pop(l) && l.msg == "6" && !c->pop(l), "per-thread container : register after retirement");
+
+        int accepted = 0;
+        for (int i=0; i<10; ++i){
+            accepted += c->push(make_log(i)) ? 1 : 0;
+        }
+        int popped = 0;
+        while (c->pop(l)){
+            ++popped;
+        }
+        check(accepted == 8 && popped == 8, "per-thread container : full ring drops");
+    }
+
+    // overflow policy test
+    {
+        using alglog::overflow_policy;
+        auto make_log = [](int i){
+            alglog::log_t l;
+            l.msg = std::to_string(i);
+            l.lvl = alglog::level::info;
+            return l;
+        };
+        alglog::log_t l;
+
+        auto drop = std::make_unique<alglog::log_container_mpsc<4, overflow_policy::drop_newest>>();
+        int accepted = 0;
+        for (int i=0; i<6; ++i){
+            accepted += drop->push(make_log(i)) ? 1 : 0;
+        }
+        check(accepted == 4 && drop->pop(l) && l.msg == "0", "overflow policy : drop_newest");
+
+        auto overwrite = std::make_unique<alglog::log_container_mpsc<4, overflow_policy::overwrite_oldest>>();
+        for (int i=0; i<6; ++i){
+            overwrite->push(make_log(i));
+        }
+        check(overwrite->dropped() == 2 && overwrite->pop(l) && l.msg == "2", "overflow policy : overwrite_oldest");
+
+        auto block = std::make_unique<alglog::log_container_mpsc<4, overflow_policy::block>>();
+        for (int i=0; i<4; ++i){
+            block->push(make_log(i));
+        }
+        check(!block->push(make_log(4)), "overflow policy : block timeout");
+
+        auto spill = std::make_unique<alglog::log_container_mpsc<4, overflow_policy::spill>>();
+        for (int i=0; i<10; ++i){
+            spill->push(make_log(i));
+        }
+        std::string order;
+        while (spill->pop(l)){
+            order += l.msg;
+        }
+        check(order == "0123456789", "overflow policy : spill");
+    }
+
+    // runtime level threshold test
+    {
+        auto lgr = std::make_shared<alglog::logger>(true);
+        auto errors = std::make_shared<capture_sink>();
+        errors->accepted_levels = alglog::level_bit(alglog::level::error) | alglog::level_bit(alglog::level::alert);
+        lgr->connect_sink(errors);
+        check(lgr->is_enabled(alglog::level::alert) && !lgr->is_enabled(alglog::level::info), "level threshold : from sink");
+        lgr->info("rejected");
+        lgr->raw_store(alglog::level::info, "rejected");
+        lgr->alert("accepted");
+
+        auto all = std::make_shared<capture_sink>();
+        lgr->connect_sink(all);
+        lgr->info("info");
+        lgr->set_level(alglog::level::error);
+        lgr->alert("below threshold");
+        lgr->error("error");
+        lgr->flush();
+        check(errors->msgs == std::vector<std::string>{"accepted", "error"}, "level threshold : sink filter");
+        check(all->msgs == std::vector<std::string>{"accepted", "info", "error"}, "level threshold : set_level");
+    }
+
+    // event-driven flusher test
+    {
+        struct count_sink : public alglog::sink{
+            std::atomic<int> count{0};
+            void output(const alglog::log_t&) override {
+                ++count;
+            }
+        };
+        auto lgr = std::make_shared<alglog::logger>(true);
+        auto cs = std::make_shared<count_sink>();
+        cs->accepted_levels = alglog::builtin::levels::release_only; // flusher内部のデバッグログを除外する
+        lgr->connect_sink(cs);
+        alglog::flusher f(lgr);
+        f.start(60 * 1000, 8); // 時間経過ではフラッシュされない
+        auto wait_count = [&](int n){
+            for (int i=0; i<200 && cs->count < n; ++i){
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+            return cs->count.load();
+        };
+        for (int i=0; i<4; ++i){
+            lgr->info("below watermark {}", i);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        check(cs->count == 0, "flusher : idle below watermark");
+        lgr->error("urgent");
+        check(wait_count(5) == 5, "flusher : wake on error");
+        for (int i=0; i<8; ++i){
+            lgr->info("burst {}", i);
+        }
+        check(wait_count(13) == 13, "flusher : wake on watermark");
+    }
+
+    // async sink test
+    {
+        // openになるまで出力をブロックするsink
+        struct gate_sink : public capture_sink{
+            std::atomic<bool> open{false};
+            std::atomic<int> entered{0};
+            void output(const alglog::log_t& l) override {
+                ++entered;
+                while (!open){
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                capture_sink::output(l);
+            }
+        };
+        auto lgr = std::make_shared<alglog::logger>(true);
+        auto slow = std::make_shared<gate_sink>();
+        auto fast = std::make_shared<capture_sink>();
+        auto as = std::make_shared<alglog::builtin::async_sink>(slow, 4, alglog::overflow_policy::drop_newest);
+        lgr->connect_sink(as);
+        lgr->connect_sink(fast);
+        lgr->info("first");
+        lgr->flush();
+        while (slow->entered == 0){
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        for (int i=0; i<6; ++i){
+            lgr->info("queued {}", i);
+        }
+        lgr->flush(); // 遅いsinkに止められずに戻る
+        check(fast->msgs.size() == 7, "async sink : other sinks not stalled");
+        check(as->queue_depth() == 4 && as->dropped() == 2, "async sink : bounded queue");
+        slow->open = true;
+        as->drain();
+        check(slow->msgs.size() == 5 && slow->msgs.back() == "queued 3", "async sink : drain");
+    }
+
+    // flat combining sync mode test
+    {
+        // スレッドごとの出力数を数えるsink。メッセージの先頭がスレッド番号
+        struct per_thread_count_sink : public alglog::sink{
+            std::array<std::atomic<int>, 8> counts{};
+            std::atomic<int> concurrent{0};
+            std::atomic<bool> overlapped{false};
+            void output(const alglog::log_t& l) override {
+                if (concurrent.fetch_add(1) != 0){
+                    overlapped = true;
+                }
+                ++counts[static_cast<size_t>(l.msg[0] - '0')];
+                --concurrent;
+            }
+        };
+        auto lgr = std::make_shared<alglog::logger>(false);
+        auto cs = std::make_shared<per_thread_count_sink>();
+        lgr->connect_sink(cs);
+        std::atomic<int> not_written{0};
+        std::vector<std::thread> threads;
+        for (int t=0; t<8; ++t){
+            threads.emplace_back([&, t]{
+                for (int i=0; i<500; ++i){
+                    lgr->info("{} combining {}", t, i);
+                    if (cs->counts[static_cast<size_t>(t)] != i + 1){
+                        ++not_written;
+                    }
+                }
+            });
+        }
+        for (auto& th : threads){
+            th.join();
+        }
+        int total = 0;
+        for (auto& c : cs->counts){
+            total += c;
+        }
+        check(total == 8 * 500 && lgr->dropped_count() == 0, "flat combining : all records written");
+        check(not_written == 0, "flat combining : written before return");
+        check(!cs->overlapped, "flat combining : single consumer");
+    }
+
+    // flat combining reentrant flush test
+    {
+        // output中に同じloggerへログを記録するsink
+        struct reentrant_sink : public alglog::sink{
+            alglog::logger* lgr = nullptr;
+            std::vector<std::string> msgs;
+            void output(const alglog::log_t& l) override {
+                msgs.push_back(l.msg);
+                if (l.msg == "trigger"){
+                    lgr->info("from sink");
+                }
+            }
+        };
+        auto lgr = std::make_shared<alglog::logger>(false);
+        auto rs = std::make_shared<reentrant_sink>();
+        rs->accepted_levels = alglog::builtin::levels::release_only;
+        rs->lgr = lgr.get();
+        lgr->connect_sink(rs);
+        lgr->info("trigger");
+        lgr->info("after");
+        check(rs->msgs.size() == 3 && rs->msgs[0] == "trigger" && rs->msgs[1] == "from sink" && rs->msgs[2] == "after", "flat combining : reentrant flush");
+    }
+
+    // copy-on-write sink list test
+    {
+        auto lgr = std::make_shared<alglog::logger>(true);
+        struct null_sink : public alglog::sink{
+            void output(const alglog::log_t&) override {}
+        };
+        alglog::flusher f(lgr);
+        f.start(1, 16);
+        std::atomic<bool> run{true};
+        std::thread producer([&]{
+            while (run){
+                lgr->info("cow");
+            }
+        });
+        bool stopped = true;
+        for (int i = 0; i < 200; ++i){
+            auto a = std::make_shared<null_sink>();
+            auto b = std::make_shared<null_sink>();
+            lgr->connect_sink(a);
+            lgr->connect_sink(b);
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+            lgr->disconnect_sink(a);
+            const auto after = a->stats().records;
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+            stopped = stopped && a->stats().records == after && lgr->disconnect_sink(b) && !lgr->disconnect_sink(a);
+        }
+        run = false;
+        producer.join();
+        check(stopped, "sink list : no output after disconnect");
+        check(lgr->telemetry().sinks.empty(), "sink list : all disconnected");
+    }
+
+#if !(defined(_WIN32) || defined(_WIN64))
+    // shared memory container test
+    {
+        using shm_container = alglog::log_container_shm<1024 * 64>;
+        const std::string name = fmt::format("/alglog_test_{}", ::get_process_id());
+        shm_container::remove(name);
+        auto collector = std::make_shared<alglog::logger>(std::make_unique<shm_container>(name, alglog::shm_role::consumer), true);
+        std::vector<alglog::log_t> logs;
+        auto ks = std::make_shared<keep_sink>(logs);
+        ks->accepted_levels = alglog::builtin::levels::release_only;
+        collector->connect_sink(ks);
+
+        const auto child = ::fork();
+        if (child == 0){
+            {
+                auto lgr = std::make_shared<alglog::logger>(std::make_unique<shm_container>(name, alglog::shm_role::producer));
+                for (int i = 0; i < 100; ++i){
+                    lgr->info("child {}", i);
+                }
+                lgr->alert(ALGLOG_SR, "child done");
+            }
+            ::_exit(0);
+        }
+        int status = 0;
+        ::waitpid(child, &status, 0);
+        {
+            auto producer = std::make_shared<alglog::logger>(std::make_unique<shm_container>(name, alglog::shm_role::producer));
+            producer->info("parent");
+            check(producer->pending_count() == 1, "shm container : producer does not drain");
+        }
+        collector->flush();
+        const auto child_pid = static_cast<uint32_t>(child);
+        check(logs.size() == 102 && logs[0].msg == "child 0" && logs[99].msg == "child 99" && logs[101].msg == "parent", "shm container : records from processes");
+        check(logs[0].pid == child_pid && logs[0].get_thread().os_tid == static_cast<uint64_t>(child) && logs[101].pid == ::get_process_id(), "shm container : pid and thread");
+        check(std::string(logs[100].loc.file) == "test.cpp" && logs[100].loc.line > 0 && logs[100].lvl == alglog::level::alert, "shm container : source location");
+        shm_container::remove(name);
+    }
+#endif
+
+#if !(defined(_WIN32) || defined(_WIN64))
+    // socket sink test
+    {
+        auto count_lines = [](const std::string& s){
+            return static_cast<size_t>(std::count(s.begin(), s.end(), '\n'));
+        };
+        auto unix_addr = [](const std::string& path){
+            sockaddr_un un{};
+            un.sun_family = AF_UNIX;
+            std::memcpy(un.sun_path, path.c_str(), path.size() + 1);
+            return un;
+        };
+
+        // unix datagram : 複数のログが1つのデータグラムに詰められる
+        const std::string dgram_path = fmt::format("/tmp/alglog_test_{}.dgram", ::get_process_id());
+        std::remove(dgram_path.c_str());
+        const int dgram = ::socket(AF_UNIX, SOCK_DGRAM, 0);
+        const auto dgram_addr = unix_addr(dgram_path);
+        ::bind(dgram, reinterpret_cast<const sockaddr*>(&dgram_addr), sizeof(dgram_addr));
+        {
+            auto lgr = std::make_shared<alglog::logger>(true);
+            auto ss = std::make_shared<alglog::builtin::socket_sink>(alglog::builtin::socket_kind::unix_datagram, dgram_path, 512);
+            ss->accepted_levels = alglog::builtin::levels::release_only;
+            ss->formatter = alglog::builtin::formatter::simple;
+            lgr->connect_sink(ss);
+            for (int i = 0; i < 100; ++i){
+                lgr->info("datagram {}", i);
+            }
+            lgr->flush();
+            check(ss->is_connected() && ss->backlog_size() == 0, "socket sink : datagram sent");
+        }
+        size_t datagrams = 0;
+        size_t lines = 0;
+        bool within_mtu = true;
+        char rbuf[4096];
+        for (ssize_t n; (n = ::recv(dgram, rbuf, sizeof(rbuf), MSG_DONTWAIT)) > 0; ){
+            ++datagrams;
+            lines += count_lines(std::string(rbuf, static_cast<size_t>(n)));
+            within_mtu = within_mtu && n <= 512;
+        }
+        check(lines == 100 && datagrams > 1 && datagrams < 100 && within_mtu, "socket sink : datagram packing");
+
+        // 受信側のキューがバッチの途中で満杯になっても、切断せずに残りを次回に送る
+        {
+            auto lgr = std::make_shared<alglog::logger>(true);
+            auto ss = std::make_shared<alglog::builtin::socket_sink>(alglog::builtin::socket_kind::unix_datagram, dgram_path, 64);
+            ss->accepted_levels = alglog::builtin::levels::release_only;
+            ss->formatter = alglog::builtin::formatter::simple;
+            lgr->connect_sink(ss);
+            for (int i = 0; i < 40; ++i){
+                lgr->info("partial {}", i);
+            }
+            errno = ENOENT; // 以前の呼び出しのerrnoが残っていても影響しない
+            lgr->flush();
+            check(ss->is_connected() && ss->stats().errors == 0 && ss->backlog_size() > 0, "socket sink : datagram queue full keeps connection");
+            size_t received = 0;
+            for (int round = 0; round < 20 && received < 40; ++round){
+                for (ssize_t n; (n = ::recv(dgram, rbuf, sizeof(rbuf), MSG_DONTWAIT)) > 0; ){
+                    received += std::string(rbuf, static_cast<size_t>(n)).find("partial") != std::string::npos ? 1 : 0;
+                }
+                lgr->info("tick");
+                lgr->flush();
+            }
+            check(received == 40 && ss->stats().errors == 0, "socket sink : datagram rest sent later");
+        }
+        for (ssize_t n; (n = ::recv(dgram, rbuf, sizeof(rbuf), MSG_DONTWAIT)) > 0; ){}
+        ::close(dgram);
+        std::remove(dgram_path.c_str());
+
+        // unix stream : エージェントが起動していない間はバックログに保持し、起動後に再接続して送る
+        const std::string stream_path = fmt::format("/tmp/alglog_test_{}.sock", ::get_process_id());
+        std::remove(stream_path.c_str());
+        auto lgr = std::make_shared<alglog::logger>(true);
+        auto ss = std::make_shared<alglog::builtin::socket_sink>(alglog::builtin::socket_kind::unix_stream, stream_path, 1400, 1024 * 1024, 0);
+        ss->accepted_levels = alglog::builtin::levels::release_only;
+        lgr->connect_sink(ss);
+        for (int i = 0; i < 50; ++i){
+            lgr->info("stream {}", i);
+        }
+        lgr->flush();
+        check(!ss->is_connected() && ss->backlog_size() > 0, "socket sink : backlog while disconnected");
+        const int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        const auto stream_addr = unix_addr(stream_path);
+        ::bind(listener, reinterpret_cast<const sockaddr*>(&stream_addr), sizeof(stream_addr));
+        ::listen(listener, 1);
+        for (int i = 50; i < 100; ++i){
+            lgr->info("stream {}", i);
+        }
+        lgr->flush();
+        const int conn = ::accept(listener, nullptr, nullptr);
+        std::string received;
+        for (ssize_t n; count_lines(received) < 100 && (n = ::recv(conn, rbuf, sizeof(rbuf), 0)) > 0; ){
+            received.append(rbuf, static_cast<size_t>(n));
+        }
+        check(count_lines(received) == 100 && ss->backlog_size() == 0 && ss->stats().bytes == received.size(), "socket sink : reconnect and send backlog");
+
+        // 相手のバッファを埋めて途中まで送ったところで切断されても、再接続後はログの先頭から送り直す
+        for (int i = 0; i < 1000; ++i){
+            lgr->info("<{:0>1000}>", i);
+        }
+        lgr->flush();
+        const bool filled = ss->backlog_size() > 0;
+        ::close(conn);
+        lgr->info("<{:0>1000}>", 1000);
+        lgr->flush(); // 切断を検知する
+        lgr->info("<{:0>1000}>", 1001);
+        lgr->flush(); // 再接続して送る
+        const int conn2 = ::accept(listener, nullptr, nullptr);
+        received.clear();
+        for (ssize_t n; received.find('\n') == std::string::npos && (n = ::recv(conn2, rbuf, sizeof(rbuf), 0)) > 0; ){
+            received.append(rbuf, static_cast<size_t>(n));
+        }
+        const auto first = received.substr(0, received.find('\n'));
+        const auto open = first.find('<');
+        check(filled && first.front() == '[' && open != std::string::npos && first.size() == open + 1002 && first.back() == '>', "socket sink : resend partially sent record");
+        ::close(conn2);
+        ::close(listener);
+        std::remove(stream_path.c_str());
+    }
+#endif
+
+    // inline message / message pool test
+    {
+        auto pool = std::make_shared<alglog::message_pool>();
+        alglog::log_message short_msg;
+        short_msg.assign("short", pool.get());
+        const std::string long_str(alglog::log_message::inline_capacity + 1, 'x');
+        alglog::log_message long_msg;
+        long_msg.assign(long_str, pool.get());
+        check(short_msg.is_inline() && short_msg == "short" && !long_msg.is_inline() && long_msg == long_str, "message : inline and pooled");
+
+        const char* block = long_msg.data();
+        alglog::log_message moved(std::move(long_msg));
+        check(moved.data() == block && long_msg.empty(), "message : move keeps block");
+
+        moved = "done"; // ブロックはプールへ返却される
+        alglog::log_message reused;
+        reused.assign(long_str, pool.get());
+        check(reused.data() == block, "message : pool reuses block");
+        check(fmt::format("[{:>6}]", short_msg) == "[ short]", "message : fmt formatter");
+    }
+
+    // thread registry test
+    {
+        auto lgr = std::make_shared<alglog::logger>(true);
+        auto cs = std::make_shared<capture_sink>();
+        cs->formatter = alglog::builtin::formatter::full;
+        lgr->connect_sink(cs);
+        std::vector<alglog::log_t> logs;
+        lgr->connect_sink(std::make_shared<keep_sink>(logs));
+        std::thread([&]{
+            alglog::set_thread_name("worker");
+            lgr->info("named");
+        }).join();
+        lgr->info("main");
+        lgr->flush();
+        const auto worker = logs.front().get_thread();
+        const auto main_thread = logs.back().get_thread();
+        check(logs.size() == 2 && worker.name == "worker" && main_thread.name.empty(), "thread registry : name");
+        check(logs.front().thread != logs.back().thread && worker.os_tid != main_thread.os_tid && worker.pid == main_thread.pid, "thread registry : distinct threads");
+        check(logs.back().thread == alglog::current_thread_index(), "thread registry : cached index");
+        alglog::pattern_formatter pf("%t");
+        check(pf(logs.front()) == fmt::format("worker({})", worker.os_tid), "thread registry : pattern label");
+        const auto main_label = alglog::get_thread_label(logs.back().thread);
+        alglog::set_thread_name("main");
+        check(main_label == fmt::format("{}", main_thread.os_tid) && alglog::get_thread_label(logs.back().thread) == fmt::format("main({})", main_thread.os_tid)
+            && alglog::builtin::formatter::full(logs.back()).find(fmt::format("main({})", main_thread.os_tid)) != std::string::npos, "thread registry : cached label");
+        alglog::set_thread_name("");
+    }
+
+    // callsite registry test
+    {
+        auto lgr = std::make_shared<alglog::logger>(true);
+        auto cs = std::make_shared<capture_sink>();
+        cs->accepted_levels = alglog::builtin::levels::release_only;
+        lgr->connect_sink(cs);
+        const int noisy_line = __LINE__ + 1;
+        auto noisy = [&](int i){ lgr->info(ALGLOG_SR, "noisy {}", i); };
+        noisy(0);
+        check(alglog::set_callsite_enabled("test.cpp", noisy_line, false) == 1, "callsite : match by file and line");
+        noisy(1);
+        lgr->flush();
+        check(cs->msgs.size() == 1 && cs->msgs.front() == "noisy 0", "callsite : disable");
+
+        alglog::set_callsite_enabled("test.cpp", noisy_line, true);
+        alglog::set_callsite_rate_limit("test.cpp", noisy_line, 1, 3);
+        for (int i = 0; i < 10; ++i){
+            noisy(i);
+        }
+        lgr->flush();
+        alglog::callsite* site = nullptr;
+        for (auto c : alglog::list_callsites()){
+            if (c->loc.line == noisy_line){
+                site = c;
+            }
+        }
+        alglog::level lvl = alglog::level::trace;
+        check(cs->msgs.size() == 4 && site && site->suppressed() == 7, "callsite : rate limit");
+        check(site && site->get_level(lvl) && lvl == alglog::level::info, "callsite : first level");
+        alglog::set_callsite_rate_limit("test.cpp", noisy_line, 0);
+    }
+
+    // telemetry test
+    {
+        auto lgr = std::make_shared<alglog::logger>();
+        auto cs = std::make_shared<capture_sink>();
+        cs->accepted_levels = alglog::builtin::levels::release_only;
+        cs->valve = [](const alglog::log_t& l){ return l.lvl != alglog::level::alert; };
+        auto fs = std::make_shared<alglog::builtin::file_sink>("telemetry.log");
+        fs->accepted_levels = alglog::builtin::levels::release_only;
+        lgr->connect_sink(cs);
+        lgr->connect_sink(fs);
+        for (int i = 0; i < 10; ++i){
+            lgr->info("info {}", i);
+        }
+        lgr->alert("alert");
+        const auto t = lgr->telemetry();
+        uint64_t histogram_total = 0;
+        for (auto n : t.flush_histogram){
+            histogram_total += n;
+        }
+        check(t.enqueued == 11 && t.dropped == 0 && t.pending == 0 && t.max_depth >= 1, "telemetry : logger counters");
+        check(t.flushes >= 11 && histogram_total == t.flushes && t.flush_ns_max <= t.flush_ns_total, "telemetry : flush histogram");
+        check(t.sinks.size() == 2 && t.sinks[0].records == 10 && t.sinks[0].rejected == 1, "telemetry : sink records");
+        check(t.sinks[1].records == 11 && t.sinks[1].bytes == fs->bytes_written() && t.sinks[1].bytes > 0 && t.sinks[1].errors == 0, "telemetry : sink bytes");
+
+        lgr->set_telemetry_report_interval(std::chrono::milliseconds(1));
+        cs->accepted_levels = alglog::builtin::levels::all;
+        lgr->update_level_mask();
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        lgr->info("report");
+        check(cs->msgs.size() == 12 && cs->msgs[10].find("[alglog] telemetry enqueued=12") == 0, "telemetry : self report");
+    }
+
+    // span / chrome trace sink test
+    {
+        auto lgr = std::make_shared<alglog::logger>();
+        std::vector<alglog::log_t> logs;
+        auto ts = std::make_shared<alglog::builtin::chrome_trace_sink>("trace.json");
+        lgr->connect_sink(ts);
+        lgr->connect_sink(std::make_shared<keep_sink>(logs));
+        {
+            alglog::trace_span outer(lgr, ALGLOG_SR, "outer", {{"frame", 42}, {"name", "a\"b"}}, alglog::level::info);
+            {
+                alglog::trace_span inner(lgr, std::string("inner"), {}, alglog::level::info);
+                inner.arg("bytes", 128u).arg("ok", true);
+                lgr->info("in span");
+            }
+            std::thread([&]{
+                alglog::set_thread_name("tracer");
+                alglog::trace_span s(lgr, "worker", {}, alglog::level::info);
+            }).join();
+        }
+        lgr->flush();
+        check(logs.size() == 7, "span : record count");
+        const auto& outer = logs[0].span;
+        const auto& inner = logs[1].span;
+        check(outer.phase == 'B' && outer.depth == 0 && outer.parent == 0 && logs[0].msg == "outer {\"frame\":42,\"name\":\"a\\\"b\"}", "span : begin");
+        check(inner.phase == 'B' && inner.depth == 1 && inner.parent == outer.id && !logs[2].span.is_span(), "span : nesting");
+        check(logs[3].span.phase == 'E' && logs[3].span.id == inner.id && logs[3].msg == "inner {\"bytes\":128,\"ok\":true}", "span : end args");
+        check(logs[4].span.depth == 0 && logs[4].span.parent == 0 && logs[6].span.id == outer.id, "span : thread local stack");
+        {
+            // ALGLOG_SPANは、debugレベルがコンパイルスイッチで無効であれば何も生成しない
+            auto mlgr = std::make_shared<alglog::logger>();
+            std::vector<alglog::log_t> mlogs;
+            mlgr->connect_sink(std::make_shared<keep_sink>(mlogs));
+            {
+                ALGLOG_SPAN(m, mlgr, "macro", {{"frame", 1}});
+                m.arg("bytes", 1);
+            }
+            mlgr->flush();
+            check(mlogs.size() == (alglog::is_compiled(alglog::level::debug) ? 2u : 0u), "span : compile switch");
+        }
+
+        lgr.reset();
+        ts.reset();
+        std::ifstream ifs("trace.json");
+        const std::string json((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        auto count = [&](const std::string& needle){
+            size_t n = 0;
+            for (auto p = json.find(needle); p != std::string::npos; p = json.find(needle, p + 1)){
+                ++n;
+            }
+            return n;
+        };
+        check(json.front() == '[' && json.substr(json.size() - 3) == "\n]\n", "chrome trace : json array");
+        check(count("\"ph\":\"B\"") == 3 && count("\"ph\":\"E\"") == 3 && count("\"ph\":\"i\"") == 1, "chrome trace : events");
+        check(count("\"args\":{\"name\":\"tracer\"}") == 1 && count("\"args\":{\"bytes\":128,\"ok\":true}") == 1, "chrome trace : thread name and args");
+    }
+
+    // structured fields / json sink test
+    {
+        // エスケープ : 8バイト単位の走査と1バイトずつの判定が一致すること
+        auto naive_escape = [](std::string_view v){
+            std::string r = "\"";
+            for (const char ch : v){
+                const auto c = static_cast<unsigned char>(ch);
+                if (c == '"') r += "\\\"";
+                else if (c == '\\') r += "\\\\";
+                else if (c == '\n') r += "\\n";
+                else if (c == '\r') r += "\\r";
+                else if (c == '\t') r += "\\t";
+                else if (c < 0x20) r += fmt::format("\\u{:04x}", c);
+                else r += ch;
+            }
+            return r + "\"";
+        };
+        bool escape_ok = true;
+        const std::string base = "plain ascii text, \xE3\x81\x82\xE3\x81\x84 utf-8 and more plain text";
+        for (size_t pos = 0; pos < base.size(); ++pos){
+            for (const char special : {'"', '\\', '\n', '\x01', '\x1f'}){
+                std::string v = base;
+                v.insert(pos, 1, special);
+                fmt::memory_buffer buf;
+                alglog::detail::append_json_string(buf, v);
+                escape_ok = escape_ok && std::string(buf.data(), buf.size()) == naive_escape(v);
+            }
+        }
+        check(escape_ok, "fields : json escape");
+
+        std::vector<alglog::log_t> logs;
+        std::remove("fields.jsonl");
+        {
+            auto lgr = std::make_shared<alglog::logger>(true, true);
+            auto ks = std::make_shared<keep_sink>(logs);
+            ks->accepted_levels = alglog::builtin::levels::release_only;
+            auto js = std::make_shared<alglog::builtin::json_file_sink>("fields.jsonl");
+            js->accepted_levels = alglog::builtin::levels::release_only;
+            lgr->connect_sink(ks);
+            lgr->connect_sink(js);
+            const std::string path = "/api/\"v1\"";
+            lgr->info(alglog::fields{{"user", 42}, {"delta", -7}, {"bytes", 4096u}, {"ratio", 0.5}, {"ok", true}, {"path", path}}, "request {}", 1);
+            lgr->alert({{"nan", std::nan("")}}, "braced");
+            lgr->info("no fields");
+            lgr->flush();
+        }
+        check(logs.size() == 3 && logs[0].msg == "request 1" && logs[2].fields.empty(), "fields : stored");
+        std::vector<std::string> kv;
+        logs[0].fields.for_each([&](const alglog::field& f){
+            fmt::memory_buffer buf;
+            f.append_to(buf);
+            kv.emplace_back(buf.data(), buf.size());
+        });
+        check(kv.size() == 6 && kv[0] == "\"user\":42" && kv[1] == "\"delta\":-7" && kv[2] == "\"bytes\":4096" && kv[3] == "\"ratio\":0.5"
+            && kv[4] == "\"ok\":true" && kv[5] == "\"path\":\"/api/\\\"v1\\\"\"", "fields : typed values");
+
+        std::ifstream ifs("fields.jsonl");
+        std::vector<std::string> lines;
+        for (std::string line; std::getline(ifs, line); ){
+            lines.push_back(line);
+        }
+        check(lines.size() == 3 && lines[0].front() == '{' && lines[0].back() == '}' && lines[0].find("\"level\":\"info\"") != std::string::npos
+            && lines[0].find("\"msg\":\"request 1\",\"fields\":{\"user\":42,\"delta\":-7,\"bytes\":4096,\"ratio\":0.5,\"ok\":true,\"path\":\"/api/\\\"v1\\\"\"}}") != std::string::npos,
+            "fields : json lines");
+        check(lines.size() == 3 && lines[1].find("\"fields\":{\"nan\":null}") != std::string::npos && lines[2].find("\"fields\"") == std::string::npos
+            && lines[0].find("\"time\":\"") == 1 && lines[0].find("Z\",\"level\"") == 35, "fields : json time and null");
+
+        alglog::pattern_formatter pf("%v %k");
+        fmt::memory_buffer pbuf;
+        pf(logs[0], pbuf);
+        check(std::string(pbuf.data(), pbuf.size()) == "request 1 user=42 delta=-7 bytes=4096 ratio=0.5 ok=true path=\"/api/\\\"v1\\\"\"", "fields : pattern");
+
+        // バイトリングバッファ・バイナリ形式でもフィールドが保持されること
+        auto c = std::make_unique<alglog::log_container_mpsc_bytes<4096>>();
+        check(c->push_message(alglog::log_t(logs[0]), logs[0].msg, nullptr), "fields : byte ring push");
+        alglog::log_t l;
+        check(c->pop(l) && l.msg == "request 1" && l.fields.blob() == logs[0].fields.blob(), "fields : byte ring roundtrip");
+        {
+            auto lgr = std::make_shared<alglog::logger>();
+            lgr->connect_sink(std::make_shared<alglog::builtin::binary_file_sink>("fields.alglog"));
+            lgr->info(alglog::fields{{"user", 42}, {"path", "p"}}, "with fields");
+            lgr->info("without fields");
+        }
+        std::ifstream bfs("fields.alglog", std::ios::binary);
+        alglog::binary::reader r(bfs);
+        size_t n = 0;
+        bool binary_ok = r.is_valid();
+        while (r.next(l)){
+            std::string js = alglog::json_formatter()(l);
+            binary_ok = binary_ok && (n == 0 ? js.find("\"fields\":{\"user\":42,\"path\":\"p\"}}") != std::string::npos : l.fields.empty());
+            ++n;
+        }
+        check(binary_ok && n == 2, "fields : binary roundtrip");
+    }
+
+    // pattern formatter test
+    {
+        alglog::log_t l;
+        l.msg = "hello";
+        l.lvl = alglog::level::warn;
+        l.pid = 42;
+        l.loc = alglog::source_location{"pattern.cpp", 7, "func"};
+        l.time = std::chrono::system_clock::time_point(std::chrono::seconds(1700000000) + std::chrono::microseconds(123456));
+
+        alglog::pattern_formatter utc("%Y-%m-%d %H:%M:%S.%f %e [%l] [%4P] [%-4#] [%12s] %% %v", true);
+        fmt::memory_buffer buf;
+        utc(l, buf);
+        const std::string expected = "2023-11-14 22:13:20.123456 123 [WARN] [  42] [7   ] [ pattern.cpp] % hello";
+        check(std::string(buf.data(), buf.size()) == expected, "pattern formatter : fields");
+
+        l.time += std::chrono::seconds(1);
+        check(utc(l).substr(0, 19) == "2023-11-14 22:13:21", "pattern formatter : time cache update");
+
+        // 既存のstd::stringフォーマッタと同じ書式になる（秒未満の表記はfmtのバージョンに依存するため比較しない）
+        l.time = std::chrono::system_clock::now();
+        alglog::pattern_formatter full(alglog::builtin::formatter::pattern::full);
+        const auto a = full(l);
+        const auto b = alglog::builtin::formatter::full(l);
+        check(a.substr(0, 20) == b.substr(0, 20) && a.substr(a.find("] [")) == b.substr(b.find("] [")), "pattern formatter : same as builtin full");
+
+        auto cs = std::make_shared<capture_sink>();
+        cs->formatter = alglog::builtin::formatter::simple;
+        fmt::memory_buffer adapted;
+        cs->format_to(l, adapted);
+        check(std::string(adapted.data(), adapted.size()) == alglog::builtin::formatter::simple(l), "pattern formatter : string formatter adapter");
+    }
+
     // multi include test
     call_from_another_source(39);
 
@@ -132,7 +1147,19 @@ int main(){
             l_async->flush();
         }
         print_last_line("time_count_async.log");
+
+        {
+            auto l_deferred = std::make_shared<alglog::logger>(true, true);
+            l_deferred->connect_sink( std::make_shared<alglog::builtin::file_sink>("time_count_deferred.log") );
+            auto t = alglog::time_counter(l_deferred, "async deferred mode (no timer flush)");
+            for(int i=0; i<num_logs; ++i){
+                l_deferred->trace("log #{} {} {}", i,i,i);
+            }
+            l_deferred->flush();
+        }
+        print_last_line("time_count_deferred.log");
     }
 
     std::cout << "end" << std::endl;
+    return test_failures == 0 ? 0 : 1;
 }
\ No newline at end of file
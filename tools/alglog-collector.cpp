@@ -0,0 +1,107 @@
+// Copyright(c) 2023-present, Kai Aoki
+// Under MIT license, but binary embeddable without copyright notice.
+// https://github.com/kuguma/alglog
+
+// 共有メモリのリングバッファ（log_container_shm）に複数のプロセスが積んだログを取り出し、sinkへ出力する。
+// アプリケーション側は shm_role::producer の log_container_shm を指定してloggerを作成する。
+// SIGINT / SIGTERM を受け取ると、残っているログを出力してから終了する。
+//
+// usage : alglog-collector [--name /alglog] [--format full|simple|console|json] [--file <path>] [--binary <path>] [--interval <ms>] [--reset]
+
+#define ALGLOG_DIRECT_INCLUDE_GUARD
+#include <alglog.h>
+
+#include <csignal>
+#include <iostream>
+#include <string>
+
+namespace {
+
+    volatile std::sig_atomic_t stop_requested = 0;
+
+    void on_signal(int){
+        stop_requested = 1;
+    }
+
+    void usage(){
+        std::cerr << "usage : alglog-collector [--name /alglog] [--format full|simple|console|json] [--file <path>] [--binary <path>] [--interval <ms>] [--reset]" << std::endl;
+    }
+
+}
+
+int main(int argc, char** argv){
+    std::string name = "/alglog";
+    std::string format = "full";
+    std::string file_path;
+    std::string binary_path;
+    int interval_ms = 100;
+    bool reset = false;
+    for (int i = 1; i < argc; ++i){
+        const std::string arg = argv[i];
+        if (arg == "--reset"){
+            reset = true;
+        }else if (i + 1 < argc && arg == "--name"){
+            name = argv[++i];
+        }else if (i + 1 < argc && arg == "--format"){
+            format = argv[++i];
+        }else if (i + 1 < argc && arg == "--file"){
+            file_path = argv[++i];
+        }else if (i + 1 < argc && arg == "--binary"){
+            binary_path = argv[++i];
+        }else if (i + 1 < argc && arg == "--interval"){
+            interval_ms = std::atoi(argv[++i]);
+        }else{
+            usage();
+            return 2;
+        }
+    }
+    if (format != "full" && format != "simple" && format != "console" && format != "json"){
+        usage();
+        return 2;
+    }
+
+    using container = alglog::log_container_shm<>;
+    if (reset){
+        container::remove(name); // 大きさの異なる古いリングや、異常終了したproducerの残したリングを破棄する
+    }
+    auto shm = std::make_unique<container>(name, alglog::shm_role::consumer);
+    if (!shm->is_open()){
+        std::cerr << "alglog-collector : cannot open shared memory " << name << " (try --reset)" << std::endl;
+        return 1;
+    }
+    auto lgr = std::make_shared<alglog::logger>(std::move(shm), true);
+
+    std::function<std::string(const alglog::log_t&)> formatter = alglog::builtin::formatter::full;
+    if (format == "simple"){
+        formatter = alglog::builtin::formatter::simple;
+    }else if (format == "console"){
+        formatter = alglog::builtin::formatter::console;
+    }else if (format == "json"){
+        formatter = alglog::json_formatter();
+    }
+    if (!file_path.empty()){
+        auto s = std::make_shared<alglog::builtin::file_sink>(file_path);
+        s->formatter = formatter;
+        lgr->connect_sink(s);
+    }
+    if (!binary_path.empty()){
+        lgr->connect_sink(std::make_shared<alglog::builtin::binary_file_sink>(binary_path));
+    }
+    if (file_path.empty() && binary_path.empty()){
+        auto s = std::make_shared<alglog::builtin::print_sink>();
+        s->formatter = formatter;
+        lgr->connect_sink(s);
+    }
+
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+
+    alglog::flusher f(lgr);
+    f.start(interval_ms);
+    while (!stop_requested){
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    f.stop();
+    lgr->flush();
+    return 0;
+}
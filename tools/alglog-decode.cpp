@@ -0,0 +1,72 @@
+// Copyright(c) 2023-present, Kai Aoki
+// Under MIT license, but binary embeddable without copyright notice.
+// https://github.com/kuguma/alglog
+
+// binary_file_sinkが書き出したバイナリログを、テキスト形式に戻して標準出力に書き出す。
+//
+// usage : alglog-decode [--format full|simple|console|json] <file>
+
+#define ALGLOG_DIRECT_INCLUDE_GUARD
+#include <alglog.h>
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+namespace {
+
+    void usage(){
+        std::cerr << "usage : alglog-decode [--format full|simple|console|json] <file>" << std::endl;
+    }
+
+}
+
+int main(int argc, char** argv){
+    std::string format = "full";
+    std::string path;
+    for (int i = 1; i < argc; ++i){
+        const std::string arg = argv[i];
+        if (arg == "--format" && i + 1 < argc){
+            format = argv[++i];
+        }else if (path.empty()){
+            path = arg;
+        }else{
+            usage();
+            return 2;
+        }
+    }
+    if (path.empty() || (format != "full" && format != "simple" && format != "console" && format != "json")){
+        usage();
+        return 2;
+    }
+
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs){
+        std::cerr << "alglog-decode : cannot open " << path << std::endl;
+        return 1;
+    }
+    alglog::binary::reader r(ifs);
+    if (!r.is_valid()){
+        std::cerr << "alglog-decode : " << path << " is not an alglog binary log" << std::endl;
+        return 1;
+    }
+
+    alglog::json_formatter json;
+    alglog::log_t l;
+    while (r.next(l)){
+        if (format == "json"){
+            std::cout << json(l) << '\n';
+        }else if (format == "full"){
+            std::cout << alglog::builtin::formatter::full(l) << '\n';
+        }else if (format == "simple"){
+            std::cout << alglog::builtin::formatter::simple(l) << '\n';
+        }else{
+            std::cout << alglog::builtin::formatter::console(l) << '\n';
+        }
+    }
+    if (ifs.bad() || (!ifs.eof() && ifs.fail())){
+        std::cerr << "alglog-decode : corrupted record in " << path << std::endl;
+        return 1;
+    }
+    return 0;
+}